@@ -31,6 +31,9 @@ extern "C" {
 	DSTATUS disk_initialize (void);
 	DRESULT disk_readp (BYTE* buff, DWORD sector, UINT offset, UINT count);
 	DRESULT disk_writep (const BYTE* buff, DWORD sc);
+	DRESULT disk_forwardp (BYTE (*func)(BYTE), DWORD sector, UINT offset, UINT* count);
+
+	#define FWD_STOPPED		0x8000	/* Flag in the count disk_forwardp() returns: the function returned 0 */
 
 	#define STA_NOINIT		0x01	/* Drive not initialized */
 	#define STA_NODISK		0x02	/* No medium in the drive */
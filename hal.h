@@ -0,0 +1,173 @@
+/*----------------------------------------------------------------------------/
+/  Hardware abstraction of the player (ATtiny861 on the Hoerbert)
+/-----------------------------------------------------------------------------/
+/ Everything main.c needs from the hardware besides the SD card (mmc.c) and the
+/ sample streaming (asmfunc.S): port setup, button ADC, PWM DAC, audio interval
+/ timer, LED shift register and delays. Another target or a host build of the
+/ player provides its own version of these functions.
+/----------------------------------------------------------------------------*/
+
+#ifndef _HAL_DEFINED
+#define _HAL_DEFINED
+
+#if HAL_HOST
+#include "hal_host.h"	/* Host build of the player, see host/sim.h */
+#else
+
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include "integer.h"
+
+// pinning
+#define LED_DATA PA3
+#define LED_CLK PA2
+#define LED_LE PA1
+
+void delay_ms (WORD);	/* Defined in asmfunc.S */
+void delay_us (WORD);	/* Defined in asmfunc.S */
+
+// Sets up the ports, the reset status and the sleep mode
+static inline void hal_init (void) {
+	MCUSR = 0;								/* Clear reset status */
+	//WDTCR = _BV(WDE) | 0b110;				/* Enable WDT (1s) */
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);	/* Select power down mode for sleep */
+	PCMSK0 = 0b11111000;					/* Select pin change interrupt pins (SW1..SW8) */
+	PCMSK1 = 0b01110000;
+
+	/* Initialize ports */
+	PORTA = 0b00000000;		/* PORTA [-LLLLLLL]*/
+	DDRA  = 0b01111111;
+	PORTB = 0b01110001;		/* PORTB [-pHHLLLp] */
+	DDRB  = 0b00111110;
+}
+
+// Initializes the analog in needed for reading the button:
+// 	   ADC Prescaler needs to be set so that the ADC input frequency is between 50 - 200kHz.
+//
+//            For more information, see table 17.5 "ADC Prescaler Selections" in
+//            chapter 17.13.2 "ADCSRA  ADC Control and Status Register A"
+//           (pages 140 and 141 on the complete ATtiny25/45/85 datasheet, Rev. 2586MAVR07/10)
+//
+//            Valid prescaler values for various clock speeds
+//
+// 	     Clock   Available prescaler values
+//            ---------------------------------------
+//              1 MHz   8 (125kHz), 16 (62.5kHz)
+//              4 MHz   32 (125kHz), 64 (62.5kHz)
+//              8 MHz   64 (125kHz), 128 (62.5kHz)
+//             16 MHz   128 (125kHz)
+//
+//   8-bit resolution:
+//   set ADLAR to 1 to enable the Left-shift result (only bits ADC9..ADC2 are available)
+//   then, only reading ADCH is sufficient for 8-bit results (256 values)
+static inline void hal_adc_init (void) {
+  ADMUX =
+            (1 << ADLAR) |     // left shift result -> 8-bit mode
+			// ref. voltage to VCC
+            (0 << REFS1) |     // Set ref. voltage bit 1
+            (0 << REFS0) |     // Set ref. voltage bit 0
+			// use ADC6 as analog input
+            (0 << MUX3)  |     // MUX bit 3
+            (1 << MUX2)  |     // MUX bit 2
+            (1 << MUX1)  |     // MUX bit 1
+            (0 << MUX0);       // MUX bit 0
+
+  ADCSRB = 0;
+
+  ADCSRA = 
+            (1 << ADEN)  |     // Enable ADC 
+            (1 << ADSC)  |     // start the first conversion, the following ones by hal_adc_start()
+            (1 << ADIE)  |     // the results are filtered by ADC_vect
+            (1 << ADPS2) |     // set prescaler bit 2 
+            (1 << ADPS1) |     // set prescaler bit 1 
+            (1 << ADPS0);      // set prescaler bit 0  
+}
+
+// Starts a single button conversion, it takes 13 ADC clocks (~104 us) and ends with ADC_vect
+static inline void hal_adc_start (void) {
+	ADCSRA |= (1 << ADSC);
+}
+
+// Returns the last button conversion (8 bit)
+static inline unsigned char hal_adc_value (void) {
+	return ADCH;
+}
+
+// Starts the ui timebase: the watchdog in interrupt mode, WDT_vect every 16 ms
+// (2K cycles of the 128 kHz watchdog oscillator)
+static inline void hal_tick_start (void) {
+	WDTCR = _BV(WDCE) | _BV(WDE);	/* Timed sequence, WDE can only be cleared along with WDCE */
+	WDTCR = _BV(WDIE);
+}
+
+// Sets both outputs of the PWM DAC
+static inline void hal_dac_write (unsigned char a, unsigned char b) {
+	OCR1A = a;
+	OCR1B = b;
+}
+
+// Starts the PWM DAC
+static inline void hal_pwm_start (void) {
+	PLLCSR = 0b00000110;	/* Select PLL clock for TC1.ck */
+	TCCR1A = 0b10100011;	/* Start TC1 with OC1A/OC1B PWM enabled */
+	TCCR1B = 0b00000001;
+}
+
+// Stops the PWM DAC
+static inline void hal_pwm_stop (void) {
+	TCCR1A = 0;	TCCR1B = 0;
+}
+
+// Starts the audio interval timer, its interrupt (TIMER0_COMPA_vect) outputs the samples
+static inline void hal_audio_timer_start (void) {
+	TCCR0A = 0b00000001;	/* Enable TC0.ck = 2MHz as interval timer */
+	TCCR0B = 0b00000010;
+	TIMSK = _BV(OCIE0A);
+}
+
+// Stops the audio interval timer
+static inline void hal_audio_timer_stop (void) {
+	TCCR0B = 0;
+}
+
+// @return Not 0 if the audio interval timer is running
+static inline unsigned char hal_audio_timer_running (void) {
+	return TCCR0B;
+}
+
+// Sets the sampling period of the audio interval timer
+//
+// @param period Number of 2 MHz ticks - 1
+static inline void hal_audio_timer_period (unsigned char period) {
+	OCR0A = period;
+}
+
+// @return The sampling period of the audio interval timer, as set by hal_audio_timer_period()
+static inline unsigned char hal_audio_timer_get_period (void) {
+	return OCR0A;
+}
+
+// Shifts the LED states out to the LED driver and latches them
+//
+// @param states One bit per LED, LED 0 is shifted out last
+static inline void hal_led_shift (uint16_t states) {
+	for (int i = 0; i < 16; i++) {
+		if ((0x8000 >> i) & states) {
+			PORTA |= (1 << LED_DATA);
+			} else {
+			PORTA &= ~(1 << LED_DATA);
+		}
+		PORTA |= (1 << LED_CLK);
+		PORTA &= ~(1 << LED_CLK);
+	}
+	PORTA |= (1 << LED_LE);
+	PORTA &= ~(1 << LED_LE);
+}
+
+// Called in every busy wait loop, the host build advances its simulated clock here
+static inline void hal_spin (void) {
+}
+
+#endif	/* HAL_HOST */
+
+#endif	/* _HAL_DEFINED */
@@ -0,0 +1,15 @@
+/*-----------------------------------------------------------------------
+/  Stand-in for <avr/interrupt.h>: the vectors become plain functions that
+/  sim.c calls at their simulated time. Interrupts only ever run inside the
+/  simulated clock (sim_advance), so cli/sei have nothing to do.
+/-----------------------------------------------------------------------*/
+
+#ifndef _HOST_AVR_INTERRUPT_H
+#define _HOST_AVR_INTERRUPT_H
+
+#define ISR(vector)				void vector (void)
+#define EMPTY_INTERRUPT(vector)	void vector (void) {}
+#define sei()
+#define cli()
+
+#endif
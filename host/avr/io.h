@@ -0,0 +1,21 @@
+/*-----------------------------------------------------------------------
+/  Stand-in for <avr/io.h>, enough to build main.c on the host (see sim.c)
+/  and to preprocess asmfunc.S for cycles.c
+/-----------------------------------------------------------------------*/
+
+#ifndef _HOST_AVR_IO_H
+#define _HOST_AVR_IO_H
+
+#define _BV(bit)	(1 << (bit))
+
+#ifdef __ASSEMBLER__
+#define _SFR_IO_ADDR(sfr)	sfr	/* The register names are kept, asmfunc.S is only read by cycles.c */
+#else
+#include <stdint.h>
+
+#define FUSES		static const unsigned char FuseBytes[] __attribute__((unused))
+
+extern uint8_t SREG;	/* Saved and restored around the probe clock reads, defined in sim.c */
+#endif
+
+#endif
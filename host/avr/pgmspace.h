@@ -0,0 +1,18 @@
+/*-----------------------------------------------------------------------
+/  Stand-in for <avr/pgmspace.h>, flash data is ordinary data on the host
+/-----------------------------------------------------------------------*/
+
+#ifndef _HOST_AVR_PGMSPACE_H
+#define _HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)				(s)
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define strcpy_P			strcpy
+#define strcmp_P			strcmp
+
+#endif
@@ -0,0 +1,3 @@
+/*-----------------------------------------------------------------------
+/  Stand-in for <avr/sleep.h>, main.c uses nothing of it on the host
+/-----------------------------------------------------------------------*/
@@ -0,0 +1,3 @@
+/*-----------------------------------------------------------------------
+/  Stand-in for <avr/wdt.h>, main.c uses nothing of it on the host
+/-----------------------------------------------------------------------*/
@@ -0,0 +1,128 @@
+/*-----------------------------------------------------------------------*/
+/* pff benchmark on FAT32 images: card traffic of open, read and seek    */
+/*-----------------------------------------------------------------------*/
+
+/* Prints one line per case with the card commands, the kilobytes clocked
+/  over the bus, the bytes actually used and the bytes fed to disk_forwardp()
+/  callbacks. These are counts, not times, so they are the same on every
+/  machine and can be compared line by line across commits. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "pff.h"
+#include "diskimg.h"
+#include "fatimg.h"
+
+#define IMAGE		"build/bench.img"
+#define STREAM_SIZE	(4UL << 20)		/* Size of the streamed file */
+#define FRAG		8				/* Clusters per fragment of a fragmented file */
+
+static FATFS Fs;
+
+
+static void report (const char *name, UINT clusterKB, const char *layout)
+{
+	printf("%-16s %2uK %-6s cmds %7lu  clocked %8lu KB  used %9lu  callbacks %8lu\n",
+		name, clusterKB, layout,
+		(unsigned long)diskImgStats.commands, (unsigned long)diskImgStats.clocked / 1024,
+		(unsigned long)diskImgStats.used, (unsigned long)diskImgStats.callbacks);
+}
+
+
+static void check (FRESULT res, const char *what)
+{
+	if (res != FR_OK) {
+		fprintf(stderr, "bench: %s failed (%d)\n", what, res);
+		exit(1);
+	}
+}
+
+
+/* Opens the last file of directories with 10 to 999 entries */
+static void bench_open (UINT clusterKB)
+{
+	static const UINT sizes[] = {10, 100, 999};
+	char name[13];
+	DWORD dirs[3];
+	UINT i, n;
+
+
+	if (fatimg_create(IMAGE, clusterKB)) exit(2);
+	for (i = 0; i < 3; i++) {
+		sprintf(name, "D%u", sizes[i]);
+		dirs[i] = fatimg_mkdir(FATIMG_ROOT, name);
+		for (n = 1; n <= sizes[i]; n++) {
+			sprintf(name, "%03u.WAV", n);
+			fatimg_add(dirs[i], name, 0, 1000, 0);
+		}
+	}
+	if (fatimg_close() || diskimg_open(IMAGE)) exit(2);
+	check(pf_mount(&Fs), "pf_mount");
+
+	for (i = 0; i < 3; i++) {
+		sprintf(name, "D%u/%03u.WAV", sizes[i], sizes[i]);
+		diskimg_reset_stats();
+		check(pf_open(name), name);
+		sprintf(name, "pf_open %u", sizes[i]);
+		report(name, clusterKB, "dir");
+	}
+}
+
+
+/* Streams a file to the wave FIFO, then jumps through it forward and backward */
+static void bench_stream (UINT clusterKB, UINT frag)
+{
+	const char *layout = frag ? "frag" : "contig";
+	DWORD ofs;
+	UINT br;
+
+
+	if (fatimg_create(IMAGE, clusterKB)) exit(2);
+	fatimg_add(FATIMG_ROOT, "STREAM.WAV", 0, STREAM_SIZE, frag);
+	if (fatimg_close() || diskimg_open(IMAGE)) exit(2);
+	check(pf_mount(&Fs), "pf_mount");
+	check(pf_open("STREAM.WAV"), "pf_open");
+
+	diskimg_reset_stats();
+	do {
+		check(pf_read(0, 1024, &br), "pf_read");
+	} while (br == 1024);
+	report("pf_read", clusterKB, layout);
+
+	check(pf_open("STREAM.WAV"), "pf_open");
+	diskimg_reset_stats();
+	for (ofs = 0; ofs < STREAM_SIZE; ofs += 100 * 1024UL) {		/* FF jumps */
+		check(pf_lseek(ofs), "pf_lseek");
+		check(pf_read(0, 512, &br), "pf_read");
+	}
+	report("pf_lseek fwd", clusterKB, layout);
+
+	diskimg_reset_stats();
+	for (ofs = STREAM_SIZE - 1; ofs > 200 * 1024UL; ofs -= 200 * 1024UL) {	/* RW jumps */
+		check(pf_lseek(ofs), "pf_lseek");
+		check(pf_read(0, 1, &br), "pf_read");
+	}
+	report("pf_lseek back", clusterKB, layout);
+
+	check(pf_open("STREAM.WAV"), "pf_open");					/* A fresh open, nothing mapped yet */
+	diskimg_reset_stats();
+	check(pf_lseek(STREAM_SIZE - 1), "pf_lseek");
+	report("pf_lseek end", clusterKB, layout);
+}
+
+
+int main (void)
+{
+	static const UINT clusters[] = {4, 16, 32};
+	UINT i;
+
+
+	for (i = 0; i < 3; i++) bench_open(clusters[i]);
+	for (i = 0; i < 3; i++) {
+		bench_stream(clusters[i], 0);
+		bench_stream(clusters[i], FRAG);
+	}
+	diskimg_close();
+	remove(IMAGE);
+	return 0;
+}
@@ -0,0 +1,357 @@
+/*-----------------------------------------------------------------------*/
+/* Cycle counts of the assembler routines against their budgets          */
+/*-----------------------------------------------------------------------*/
+
+/* Reads asmfunc.S preprocessed for one MODE and FIFO_IN_GPIOR setting from
+/  stdin (see "make cycles"), expands the macros and .rept blocks and counts
+/  the cycles the ATtiny861 takes for the longest path through each routine
+/  of the table below. Conditional branches back into a loop are taken as
+/  often as the routine says, 0 for the FIFO full wait, so the counts are
+/  those of a FIFO that is not full. It prints the counts and the share of
+/  the CPU the audio ISR takes at the common sampling rates, and exits with 1
+/  if any count is over its budget, the table in asmfunc.S repeated in
+/  Routines[]. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define MAX_LINES	4096
+#define MAX_MACROS	16
+#define MAX_BODY	64		/* Lines of a macro */
+#define MAX_INSNS	4096
+#define MAX_LABELS	512
+
+typedef struct {
+	const char *name;	/* Global label */
+	const char *loop;	/* Local label of the loop a pass of which is counted up to the branch back to it, 0:Up to the return */
+	int loops;			/* Times the branch back into an inner loop is taken */
+	int extra;			/* Cycles before the first instruction, rcall or interrupt response and vector jump */
+	int sample;			/* A pass outputs a sample (1) or moves a byte on the bus (0) */
+	int bytes;			/* Bytes received per pass */
+	int budget[2][3];	/* Cycles per pass in MODE 0, 1, 2, without and with FIFO_IN_GPIOR */
+} ROUTINE;
+
+static const ROUTINE Routines[] = {
+	/* Per sample */
+	{"fwd_mono8",			"1",	0,	0,	1,	1,	{{46, 45, 45}, {44, 43, 43}}},
+	{"fwd_stereo8",			"1",	0,	0,	1,	2,	{{66, 62, 66}, {64, 60, 64}}},
+	{"fwd_mono16",			"1",	0,	0,	1,	2,	{{63, 62, 63}, {61, 60, 61}}},
+	{"fwd_stereo16",		"1",	0,	0,	1,	4,	{{100, 96, 104}, {98, 94, 102}}},
+	{"TIMER0_COMPA_vect",	0,		0,	6,	1,	0,	{{52, 52, 52}, {41, 41, 41}}},
+	/* Per byte */
+	{"rcv_spi",				0,		0,	3,	0,	1,	{{26, 26, 26}, {26, 26, 26}}},
+	{"xmit_spi",			0,		7,	3,	0,	1,	{{83, 83, 83}, {83, 83, 83}}},
+	{"fb_exit",				"9",	0,	0,	0,	1,	{{20, 20, 20}, {20, 20, 20}}}	/* Tail discard loop */
+};
+
+static const unsigned long Rates[] = {8000, 22050, 44100, 48000};
+
+typedef struct {
+	char name[16];
+	char param[4][16];
+	int nparams;
+	int first, count;	/* Body in MacroLines[] */
+} MACRO;
+
+typedef struct {
+	char op[8];
+	char arg[48];
+} INSN;
+
+typedef struct {
+	char name[32];
+	int at;				/* Index of the instruction that follows the label */
+} LABEL;
+
+static char Lines[MAX_LINES][128];
+static int NumLines;
+static char MacroLines[MAX_LINES][128];
+static int NumMacroLines;
+static MACRO Macros[MAX_MACROS];
+static int NumMacros;
+static INSN Insns[MAX_INSNS];
+static int NumInsns;
+static LABEL Labels[MAX_LABELS];
+static int NumLabels;
+
+
+static void fail (const char *msg, const char *what)
+{
+	fprintf(stderr, "cycles: %s: %s\n", msg, what);
+	exit(2);
+}
+
+
+/* Copies the first word of s (up to a blank or a comma) to w, returns the rest */
+static const char* word (const char *s, char *w, size_t size)
+{
+	size_t n = 0;
+
+
+	while (isspace((unsigned char)*s) || *s == ',') s++;
+	while (*s && !isspace((unsigned char)*s) && *s != ',') {
+		if (n + 1 < size) w[n++] = *s;
+		s++;
+	}
+	w[n] = 0;
+	return s;
+}
+
+
+/* Reads the source without comments, line markers and empty lines */
+static void read_source (FILE *f)
+{
+	char buf[512], *p;
+	size_t n;
+
+
+	while (fgets(buf, sizeof buf, f)) {
+		if (buf[0] == '#') continue;
+		if ((p = strchr(buf, ';')) != 0) *p = 0;
+		for (p = buf; isspace((unsigned char)*p); p++) ;
+		n = strlen(p);
+		while (n && isspace((unsigned char)p[n - 1])) p[--n] = 0;
+		if (!n) continue;
+		if (NumLines == MAX_LINES || n >= sizeof Lines[0]) fail("source too large", p);
+		strcpy(Lines[NumLines++], p);
+	}
+}
+
+
+static void add_label (const char *name)
+{
+	if (NumLabels == MAX_LABELS) fail("too many labels", name);
+	strcpy(Labels[NumLabels].name, name);
+	Labels[NumLabels++].at = NumInsns;
+}
+
+
+/* Replaces \param by the arguments of a macro call */
+static void substitute (char *out, const char *in, const MACRO *m, char args[][16])
+{
+	int i;
+	size_t n = 0;
+
+
+	while (*in) {
+		if (*in == '\\') {
+			for (i = 0; i < m->nparams; i++) {
+				n = strlen(m->param[i]);
+				if (!strncmp(in + 1, m->param[i], n) && !isalnum((unsigned char)in[1 + n])) break;
+			}
+			if (i == m->nparams) fail("unknown macro parameter", in);
+			strcpy(out, args[i]);
+			out += strlen(out);
+			in += 1 + n;
+		} else {
+			*out++ = *in++;
+		}
+	}
+	*out = 0;
+}
+
+
+/* Index of the line that closes the block opened by lines[i] */
+static int block_end (char lines[][128], int i, int n, const char *open, const char *close)
+{
+	int depth = 0;
+	char w[16];
+
+
+	for (; i < n; i++) {
+		word(lines[i], w, sizeof w);
+		if (!strcmp(w, open)) depth++;
+		if (!strcmp(w, close) && !--depth) return i;
+	}
+	fail("unterminated block", open);
+	return 0;
+}
+
+
+/* Turns lines into instructions and labels, expanding .rept blocks and macros */
+static void expand (char lines[][128], int n)
+{
+	char w[32], label[32], args[4][16], body[MAX_BODY][128];
+	const char *s, *c;
+	int i, e, k;
+	MACRO *m;
+
+
+	for (i = 0; i < n; i++) {
+		s = lines[i];
+		while ((c = strchr(s, ':')) != 0 && !memchr(s, ' ', c - s) && !memchr(s, '\t', c - s)) {	/* Labels */
+			if ((size_t)(c - s) >= sizeof label) fail("label too long", s);
+			memcpy(label, s, c - s);
+			label[c - s] = 0;
+			add_label(label);
+			for (s = c + 1; isspace((unsigned char)*s); s++) ;
+		}
+		if (!*s) continue;
+		c = word(s, w, sizeof w);
+
+		if (!strcmp(w, ".macro")) {
+			e = block_end(lines, i, n, ".macro", ".endm");
+			if (NumMacros == MAX_MACROS) fail("too many macros", c);
+			m = &Macros[NumMacros++];
+			c = word(c, m->name, sizeof m->name);
+			for (m->nparams = 0; m->nparams < 4; m->nparams++) {
+				c = word(c, m->param[m->nparams], sizeof m->param[0]);
+				if (!m->param[m->nparams][0]) break;
+			}
+			m->first = NumMacroLines;
+			m->count = e - i - 1;
+			for (k = i + 1; k < e; k++) strcpy(MacroLines[NumMacroLines++], lines[k]);
+			i = e;
+			continue;
+		}
+		if (!strcmp(w, ".rept")) {
+			e = block_end(lines, i, n, ".rept", ".endr");
+			for (k = atoi(c); k > 0; k--) expand(lines + i + 1, e - i - 1);
+			i = e;
+			continue;
+		}
+		if (w[0] == '.') continue;		/* Other directives */
+
+		for (m = Macros; m < Macros + NumMacros && strcmp(m->name, w); m++) ;
+		if (m < Macros + NumMacros) {
+			if (m->count > MAX_BODY) fail("macro too long", w);
+			for (k = 0; k < 4; k++) c = word(c, args[k], sizeof args[k]);
+			for (k = 0; k < m->count; k++) substitute(body[k], MacroLines[m->first + k], m, args);
+			expand(body, m->count);
+			continue;
+		}
+
+		if (NumInsns == MAX_INSNS) fail("too many instructions", s);
+		for (k = 0; w[k] && k < 7; k++) Insns[NumInsns].op[k] = (char)tolower((unsigned char)w[k]);
+		Insns[NumInsns].op[k] = 0;
+		while (isspace((unsigned char)*c)) c++;
+		snprintf(Insns[NumInsns].arg, sizeof Insns[0].arg, "%s", c);
+		NumInsns++;
+	}
+}
+
+
+/* Index of the instruction at a label, local labels ("1f", "1b") are searched from pc */
+static int find_label (const char *name, int pc)
+{
+	char local[32];
+	size_t n = strlen(name);
+	int i;
+
+
+	if (n > 1 && isdigit((unsigned char)name[0]) && (name[n - 1] == 'f' || name[n - 1] == 'b')) {
+		memcpy(local, name, n - 1);
+		local[n - 1] = 0;
+		if (name[n - 1] == 'f') {
+			for (i = 0; i < NumLabels; i++) if (Labels[i].at > pc && !strcmp(Labels[i].name, local)) return Labels[i].at;
+		} else {
+			for (i = NumLabels - 1; i >= 0; i--) if (Labels[i].at <= pc && !strcmp(Labels[i].name, local)) return Labels[i].at;
+		}
+	} else {
+		for (i = 0; i < NumLabels; i++) if (!strcmp(Labels[i].name, name)) return Labels[i].at;
+	}
+	fail("label not found", name);
+	return 0;
+}
+
+
+/* Cycles of an instruction on the AVRe core, branches not taken */
+static int insn_cycles (const char *op)
+{
+	static const char *const two[] = {"adiw", "sbiw", "lds", "sts", "ld", "ldd", "st", "std", "push", "pop", "rjmp", "ijmp", "sbi", "cbi", 0};
+	int i;
+
+
+	if (!strcmp(op, "ret") || !strcmp(op, "reti")) return 4;
+	if (!strcmp(op, "rcall") || !strcmp(op, "icall") || !strcmp(op, "lpm")) return 3;
+	for (i = 0; two[i]; i++) if (!strcmp(op, two[i])) return 2;
+	return 1;
+}
+
+
+/* Cycles of the longest path from pc to the return or to the branch back to loop,
+/  a branch back to an inner loop is taken loops times (taken so far) */
+static int walk (int pc, int loop, int loops, int taken)
+{
+	static const char *const unsupported[] = {"ijmp", "icall", "rcall", "cpse", "sbrc", "sbrs", "sbic", "sbis", 0};
+	char target[32];
+	int t, a, b, i;
+	int cycles = 0;
+
+
+	for (;;) {
+		if (pc >= NumInsns) fail("path runs off the end", "");
+		if (!strcmp(Insns[pc].op, "ret") || !strcmp(Insns[pc].op, "reti")) return cycles + 4;
+		for (i = 0; unsupported[i] && strcmp(Insns[pc].op, unsupported[i]); i++) ;
+		if (unsupported[i]) fail("can't follow", Insns[pc].op);		/* Not used in the counted paths */
+		if (!strcmp(Insns[pc].op, "rjmp")) {
+			word(Insns[pc].arg, target, sizeof target);
+			cycles += 2;
+			pc = find_label(target, pc);
+			continue;
+		}
+		if (!strncmp(Insns[pc].op, "br", 2)) {
+			word(Insns[pc].arg, target, sizeof target);
+			t = find_label(target, pc);
+			if (t == loop) return cycles + 2;		/* Next pass */
+			if (t <= pc) {						/* Inner loop */
+				if (taken < loops) {
+					cycles += 2;
+					taken++;
+					pc = t;
+				} else {
+					cycles += 1;
+					taken = 0;
+					pc++;
+				}
+				continue;
+			}
+			a = 2 + walk(t, loop, loops, taken);
+			b = 1 + walk(pc + 1, loop, loops, taken);
+			return cycles + (a > b ? a : b);
+		}
+		cycles += insn_cycles(Insns[pc].op);
+		pc++;
+	}
+}
+
+
+int main (int argc, char *argv[])
+{
+	const ROUTINE *r;
+	char local[32];
+	int mode, gpior, i, k, start, loop, n, budget, over = 0;
+
+
+	if (argc < 3 || (mode = atoi(argv[1])) < 0 || mode > 2 || (gpior = atoi(argv[2])) < 0 || gpior > 1) {
+		fprintf(stderr, "usage: cycles MODE FIFO_IN_GPIOR < asmfunc.S preprocessed with these settings\n");
+		return 2;
+	}
+	read_source(stdin);
+	expand(Lines, NumLines);
+
+	printf("MODE %d%s\n", mode, gpior ? ", FIFO_IN_GPIOR" : "");
+	for (i = 0; i < (int)(sizeof Routines / sizeof Routines[0]); i++) {
+		r = &Routines[i];
+		start = find_label(r->name, 0);
+		loop = -1;
+		if (r->loop) {
+			snprintf(local, sizeof local, "%sf", r->loop);
+			start = loop = find_label(local, start - 1);
+		}
+		n = r->extra + walk(start, loop, r->loops, 0);
+		budget = r->budget[gpior][mode];
+		printf("  %-18s %4d cycles per %s", r->name, n, r->sample ? "sample" : "byte");
+		if (r->sample && r->bytes > 1) printf(" (%.1f per byte)", (double)n / r->bytes);
+		printf(", budget %d%s\n", budget, n > budget ? "  OVER BUDGET" : "");
+		if (!r->bytes) {
+			printf("  %-18s", "  share of the CPU");
+			for (k = 0; k < (int)(sizeof Rates / sizeof Rates[0]); k++) printf(" %5.1f%% at %.2f kHz", n * (Rates[k] / 1000.0) / 160.0, Rates[k] / 1000.0);
+			printf("\n");
+		}
+		if (n > budget) over = 1;
+	}
+	return over;
+}
@@ -0,0 +1,283 @@
+/*-----------------------------------------------------------------------*/
+/* Host disk backend: diskio.h on a disk image file                      */
+/*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "pffconf.h"
+#include "diskimg.h"
+
+
+DISKIMG_STATS diskImgStats;
+void (*diskImgWave)(const BYTE *data, UINT count);
+void (*diskImgClock)(DWORD cycles);
+const DISKIMG_LATENCY *diskImgLatency;
+
+#define WAIT_TOKEN	0		/* Data token of a read command */
+#define WAIT_BLOCK	1		/* Further block of a multiple block read */
+#define WAIT_BUSY	2		/* Busy time after a block write */
+
+static FILE *Img;
+static BYTE Block[512];		/* Sector being read or written */
+static DWORD Seed;			/* State of the latency draws */
+static DWORD Blocks;		/* Blocks since the last garbage collection stall */
+static DWORD WriteSect;		/* Sector of the running write */
+static UINT WriteCnt;		/* Bytes left to send to the running write */
+#if _USE_STREAM
+static DWORD StrmSect;		/* Next sector of the running multiple block read (0:Not running) */
+#endif
+
+
+static
+void clock_cycles (
+	DWORD cycles
+)
+{
+	if (diskImgClock) diskImgClock(cycles);
+}
+
+
+static
+DWORD draw (
+	DWORD min,
+	DWORD max
+)
+{
+	Seed = Seed * 1103515245 + 12345;
+	return max > min ? min + (Seed >> 8) % (max - min + 1) : min;
+}
+
+
+/* Draws a wait from a LATE histogram, in polls. Class n holds 2^(n-1) to
+/  2^n-1 polls, the open last class is taken as 256 to 511. */
+static
+DWORD draw_late (
+	const WORD *late,
+	UINT col		/* 0:Read waits, 1:Write waits */
+)
+{
+	DWORD total = 0, r;
+	UINT c;
+
+
+	for (c = 0; c < DISKIMG_LATE_CLASSES; c++) total += late[c * 2 + col];
+	if (!total) return 0;
+	r = draw(0, total - 1);
+	for (c = 0; r >= late[c * 2 + col]; c++) r -= late[c * 2 + col];
+	return c ? draw(1UL << (c - 1), (1UL << c) - 1) : 0;
+}
+
+
+/* Lets the time pass the card keeps the host waiting */
+static
+void card_wait (
+	UINT kind		/* WAIT_TOKEN, WAIT_BLOCK or WAIT_BUSY */
+)
+{
+	const DISKIMG_LATENCY *m = diskImgLatency;
+	DWORD cycles;
+
+
+	if (!m) {
+		if (kind == WAIT_BUSY) clock_cycles(DISKIMG_BUSY_CYCLES);
+		return;
+	}
+	if (m->late) {
+		cycles = kind == WAIT_BUSY ? draw_late(m->late, 1) * DISKIMG_WRITE_POLL_CYCLES : draw_late(m->late, 0) * DISKIMG_READ_POLL_CYCLES;
+	} else {
+		switch (kind) {
+		case WAIT_TOKEN: cycles = draw(m->tokenMin, m->tokenMax); break;
+		case WAIT_BLOCK: cycles = draw(m->blockMin, m->blockMax); break;
+		default: cycles = draw(m->busyMin, m->busyMax); break;
+		}
+		cycles *= 16;
+	}
+	if (m->gcPeriod && ++Blocks >= m->gcPeriod) {
+		Blocks = 0;
+		cycles += m->gcUs * 16;
+	}
+	diskImgStats.waited += cycles;
+	if (cycles > diskImgStats.longest) diskImgStats.longest = cycles;
+	clock_cycles(cycles);
+}
+
+
+static
+int read_block (
+	DWORD lba
+)
+{
+	memset(Block, 0, sizeof Block);		/* Sectors past the end of a sparse image read as zeros */
+	if (fseek(Img, (long)lba * 512, SEEK_SET)) return 1;
+	fread(Block, 1, sizeof Block, Img);
+	diskImgStats.clocked += 514;
+	return 0;
+}
+
+
+#if _USE_STREAM
+static
+void stop_stream (void)
+{
+	if (StrmSect) {
+		StrmSect = 0;
+		diskImgStats.commands++;		/* CMD12 */
+		clock_cycles(DISKIMG_CMD_CYCLES);
+	}
+}
+#endif
+
+
+
+int diskimg_open (
+	const char *path
+)
+{
+	diskimg_close();
+	Img = fopen(path, "r+b");
+	Seed = 1;
+	Blocks = 0;
+	return Img ? 0 : 1;
+}
+
+
+void diskimg_close (void)
+{
+	if (Img) fclose(Img);
+	Img = 0;
+#if _USE_STREAM
+	StrmSect = 0;
+#endif
+}
+
+
+void diskimg_reset_stats (void)
+{
+	memset(&diskImgStats, 0, sizeof diskImgStats);
+}
+
+
+
+DSTATUS disk_initialize (void)
+{
+#if _USE_STREAM
+	StrmSect = 0;
+#endif
+	return Img ? 0 : STA_NOINIT;
+}
+
+
+
+DRESULT disk_readp (
+	BYTE *dest,		/* Pointer to the destination object (NULL:Forward to the wave FIFO) */
+	DWORD lba,		/* Start sector number (LBA) */
+	UINT ofs,		/* Byte offset in the sector (0..511) */
+	UINT cnt		/* Byte count (1..512) */
+)
+{
+	if (!Img || ofs + cnt > 512) return RES_PARERR;
+
+	diskImgStats.readp++;
+#if _USE_STREAM
+	if (!dest && lba == StrmSect) {		/* Next sector of the running multiple block read */
+		StrmSect = lba + 1;
+		card_wait(WAIT_BLOCK);
+	} else {
+		stop_stream();
+		diskImgStats.commands++;		/* CMD17, or CMD18 to forward wave data */
+		clock_cycles(DISKIMG_CMD_CYCLES);
+		card_wait(WAIT_TOKEN);
+		StrmSect = dest ? 0 : lba + 1;
+	}
+#else
+	diskImgStats.commands++;			/* CMD17 */
+	clock_cycles(DISKIMG_CMD_CYCLES);
+	card_wait(WAIT_TOKEN);
+#endif
+	if (read_block(lba)) return RES_ERROR;
+	diskImgStats.used += cnt;
+
+	if (dest) {
+		memcpy(dest, &Block[ofs], cnt);
+		clock_cycles(cnt * DISKIMG_RCV_CYCLES + (514 - cnt) * DISKIMG_SKIP_CYCLES);
+	} else {
+		clock_cycles((514 - cnt) * DISKIMG_SKIP_CYCLES);
+		if (diskImgWave) diskImgWave(&Block[ofs], cnt);
+	}
+	return RES_OK;
+}
+
+
+
+DRESULT disk_forwardp (
+	BYTE (*func)(BYTE),	/* Function to feed the data bytes to (returns 0 to stop forwarding) */
+	DWORD lba,		/* Start sector number (LBA) */
+	UINT ofs,		/* Byte offset in the sector (0..511) */
+	UINT *cnt		/* Byte count (1..512), returns number of bytes fed to the function, with FWD_STOPPED if it stopped */
+)
+{
+	UINT n, st;
+
+
+	if (!Img || !*cnt || ofs + *cnt > 512) return RES_PARERR;
+
+	diskImgStats.forwardp++;
+#if _USE_STREAM
+	stop_stream();
+#endif
+	diskImgStats.commands++;			/* CMD17 */
+	clock_cycles(DISKIMG_CMD_CYCLES);
+	card_wait(WAIT_TOKEN);
+	if (read_block(lba)) return RES_ERROR;
+
+	n = 0; st = 0;
+	do {								/* Feed data bytes until stopped or count reached */
+		n++;
+		if (!func(Block[ofs + n - 1])) st = FWD_STOPPED;
+	} while (!st && n < *cnt);
+	*cnt = n | st;
+	diskImgStats.callbacks += n;
+	diskImgStats.used += n;
+	clock_cycles(n * DISKIMG_FWD_CYCLES + (514 - n) * DISKIMG_RCV_CYCLES);
+	return RES_OK;
+}
+
+
+
+DRESULT disk_writep (
+	const BYTE *buff,	/* Pointer to the bytes to be written (NULL:Initiate/Finalize sector write) */
+	DWORD sc			/* Number of bytes to send, Sector number (LBA) or zero */
+)
+{
+	if (!Img) return RES_NOTRDY;
+
+	if (buff) {				/* Send data bytes */
+		while (sc && WriteCnt) {
+			Block[512 - WriteCnt--] = *buff++;
+			sc--;
+			clock_cycles(DISKIMG_XMIT_CYCLES);
+		}
+		return RES_OK;
+	}
+	if (sc) {				/* Initiate sector write process */
+#if _USE_STREAM
+		stop_stream();
+#endif
+		diskImgStats.commands++;		/* CMD24 */
+		clock_cycles(DISKIMG_CMD_CYCLES);
+		memset(Block, 0, sizeof Block);	/* Left bytes are filled with zeros */
+		WriteSect = sc;
+		WriteCnt = 512;
+		return RES_OK;
+	}
+	/* Finalize sector write process */
+	diskImgStats.clocked += 514;
+	diskImgStats.used += 512 - WriteCnt;
+	diskImgStats.writes++;
+	clock_cycles((WriteCnt + 2) * DISKIMG_RCV_CYCLES);	/* Zeros clocked by rcv_spi() with DO low */
+	card_wait(WAIT_BUSY);
+	WriteCnt = 0;
+	if (fseek(Img, (long)WriteSect * 512, SEEK_SET) || fwrite(Block, 1, 512, Img) != 512) return RES_ERROR;
+	fflush(Img);
+	return RES_OK;
+}
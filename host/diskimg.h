@@ -0,0 +1,74 @@
+/*-----------------------------------------------------------------------
+/  Host disk backend: diskio.h on a disk image file
+/-----------------------------------------------------------------------*/
+
+#ifndef _DISKIMG_DEFINED
+#define _DISKIMG_DEFINED
+
+#include "diskio.h"
+
+/* The backend behaves like mmc.c towards pff.c: disk_readp() with a NULL
+/  destination starts or continues a multiple block read (_USE_STREAM), any
+/  other access stops it, and every block is clocked in completely. The first
+/  three counters are those of DISK_STATS in probe.h, so numbers measured here
+/  compare with the ones the firmware writes to STATS.DAT. */
+
+typedef struct {
+	DWORD	commands;	/* Commands sent to the card (CMD12/17/18/24) */
+	DWORD	clocked;	/* Data block bytes clocked in or out, incl. CRC */
+	DWORD	used;		/* Data block bytes actually used by the caller */
+	DWORD	readp;		/* disk_readp() calls */
+	DWORD	forwardp;	/* disk_forwardp() calls */
+	DWORD	callbacks;	/* Bytes fed to disk_forwardp() functions */
+	DWORD	writes;		/* Sectors written */
+	DWORD	waited;		/* Cycles the card kept the host waiting (latency model only) */
+	DWORD	longest;	/* Longest of these waits in cycles */
+} DISKIMG_STATS;
+
+extern DISKIMG_STATS diskImgStats;
+
+/* Receives the bytes disk_readp() forwards to the wave FIFO (NULL destination),
+/  they are dropped if not set */
+extern void (*diskImgWave)(const BYTE *data, UINT count);
+
+/* Receives the time every transfer would take on the target, in cycles of the
+/  16 MHz CPU, for the player simulation (sim.c). The forwarded wave bytes are
+/  not included, their time depends on the forwarding kernel. */
+extern void (*diskImgClock)(DWORD cycles);
+
+#define DISKIMG_CMD_CYCLES	800		/* Command frame, response and data token */
+#define DISKIMG_RCV_CYCLES	26		/* Byte received by rcv_spi() */
+#define DISKIMG_SKIP_CYCLES	20		/* Byte skipped by fwd_blk_part() */
+#define DISKIMG_FWD_CYCLES	40		/* Byte received and fed to a disk_forwardp() function */
+#define DISKIMG_XMIT_CYCLES	83		/* Byte sent by xmit_spi() */
+#define DISKIMG_BUSY_CYCLES	16000	/* Card busy after a block write (1 ms) */
+
+/* Latency model of a card. Without one (diskImgLatency NULL) the card answers
+/  at once and is busy for DISKIMG_BUSY_CYCLES after a write. With one, every
+/  data token, every further block of a multiple block read and every write
+/  busy time is drawn from the ranges, or from a recorded LATE histogram of
+/  STATS.DAT (see README.md), and a garbage collection stall is added after
+/  every gcPeriod blocks. The draws are pseudo random from a fixed seed, so a
+/  run is repeatable. */
+
+#define DISKIMG_LATE_CLASSES	10		/* Classes of a LATE histogram, LATENCY_CLASSES of probe.h */
+#define DISKIMG_READ_POLL_CYCLES	30		/* A read poll of mmc.c, rcv_spi() and the loop */
+#define DISKIMG_WRITE_POLL_CYCLES	1630	/* A write poll of mmc.c, rcv_spi() and delay_us(100) */
+
+typedef struct {
+	const char	*name;
+	DWORD	tokenMin, tokenMax;	/* Wait for the data token of a read command, us */
+	DWORD	blockMin, blockMax;	/* Wait for each further block of a multiple block read, us */
+	DWORD	busyMin, busyMax;	/* Busy time after a block write, us */
+	DWORD	gcPeriod;			/* Blocks read or written between two garbage collection stalls, 0:None */
+	DWORD	gcUs;				/* Length of a stall, us */
+	const WORD *late;			/* LATE histogram to replay instead of the ranges (read and write count of each class), NULL:None */
+} DISKIMG_LATENCY;
+
+extern const DISKIMG_LATENCY *diskImgLatency;
+
+int diskimg_open (const char *path);	/* Opens an image for read and write, 0 if OK */
+void diskimg_close (void);
+void diskimg_reset_stats (void);
+
+#endif	/* _DISKIMG_DEFINED */
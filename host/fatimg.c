@@ -0,0 +1,502 @@
+/*-----------------------------------------------------------------------*/
+/* FAT32 and exFAT image builder for the host tests and benchmarks       */
+/*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fatimg.h"
+
+#define RSVD_SECTORS	32
+#define NUM_FATS		2
+#define NUM_CLUSTERS	65600UL	/* Just above the FAT16 limit, pff tells the FAT type by the cluster count */
+#define MAX_DIRS		64
+#define TIMESTAMP		0x4A216000UL	/* 2017-01-01 12:00:00 */
+
+typedef struct {
+	DWORD	first;		/* Start cluster */
+	DWORD	last;		/* Last cluster of the chain */
+	UINT	entries;	/* Entries used */
+	DWORD	parent;		/* exFAT: parent directory and index of the entry set in it, */
+	UINT	slot;		/*  the size is written there on close */
+	char	name[13];
+} IMGDIR;
+
+static FILE *Img;
+static unsigned int *Fat;	/* FAT entries (32 bit) */
+static DWORD Spc;			/* Sectors per cluster */
+static DWORD FatSz;			/* Sectors per FAT */
+static DWORD DataStart;		/* First sector of cluster 2 */
+static DWORD NextFree;		/* Next cluster to allocate */
+static IMGDIR Dirs[MAX_DIRS];
+static UINT NumDirs;
+static BYTE Exfat;			/* exFAT volume */
+static BYTE *Used;			/* exFAT allocation bitmap, bit 0 is cluster 2 */
+static DWORD Bitmap;		/* exFAT: first cluster of the allocation bitmap */
+
+
+static void put16 (BYTE *p, DWORD v) { p[0] = (BYTE)v; p[1] = (BYTE)(v >> 8); }
+static void put32 (BYTE *p, DWORD v) { put16(p, v); put16(p + 2, v >> 16); }
+
+
+static
+int write_at (
+	DWORD sect,
+	UINT ofs,
+	const void *data,
+	UINT size
+)
+{
+	if (fseek(Img, (long)sect * 512 + ofs, SEEK_SET)) return 1;
+	return fwrite(data, 1, size, Img) != size;
+}
+
+
+DWORD fatimg_sector (
+	DWORD clust
+)
+{
+	return DataStart + (clust - 2) * Spc;
+}
+
+
+static
+DWORD alloc_cluster (
+	DWORD prev		/* Cluster to link the new one to (0:Start a chain) */
+)
+{
+	DWORD c = NextFree++;
+
+
+	if (c >= NUM_CLUSTERS + 2) {
+		fprintf(stderr, "fatimg: volume full\n");
+		exit(2);
+	}
+	Fat[c] = Exfat ? 0xFFFFFFFF : 0x0FFFFFFF;
+	Used[(c - 2) / 8] |= 1 << (c - 2) % 8;
+	if (prev) Fat[prev] = (unsigned int)c;
+	return c;
+}
+
+
+static
+void make_sfn (
+	BYTE *sfn,
+	const char *name
+)
+{
+	UINT i = 0, n = 0;
+
+
+	memset(sfn, ' ', 11);
+	if (name[0] == '.') {		/* Dot entries "." and ".." */
+		memcpy(sfn, name, strlen(name));
+		return;
+	}
+	for (; *name; name++) {
+		if (*name == '.') { i = 8; n = 11; continue; }
+		if (!n) n = 8;
+		if (i < n) sfn[i++] = (BYTE)(*name >= 'a' && *name <= 'z' ? *name - 0x20 : *name);
+	}
+}
+
+
+static
+IMGDIR* find_dir (
+	DWORD clust
+)
+{
+	UINT i;
+
+
+	for (i = 0; i < NumDirs; i++) {
+		if (Dirs[i].first == clust) return &Dirs[i];
+	}
+	fprintf(stderr, "fatimg: no directory at cluster %lu\n", (unsigned long)clust);
+	exit(2);
+}
+
+
+static
+int write_entry (
+	IMGDIR *d,
+	UINT index,			/* Entry index in the directory */
+	const BYTE *e
+)
+{
+	DWORD per_clust = Spc * 16, c = d->first, ofs;
+	UINT n;
+
+
+	for (n = index / per_clust; n; n--) c = Fat[c];	/* Directories always have a FAT chain */
+	ofs = (index % per_clust) * 32;
+	return write_at(fatimg_sector(c) + ofs / 512, ofs % 512, e, 32);
+}
+
+
+static
+UINT put_entry (
+	DWORD parent,
+	const BYTE *e
+)
+{
+	IMGDIR *d = find_dir(parent);
+
+
+	if (d->entries && d->entries % (Spc * 16) == 0) {	/* Directory cluster full, extend the chain */
+		d->last = alloc_cluster(d->last);
+	}
+	write_entry(d, d->entries, e);
+	return d->entries++;
+}
+
+
+static
+void add_entry (
+	DWORD parent,
+	const char *name,
+	BYTE attr,
+	DWORD clust,
+	DWORD size
+)
+{
+	BYTE e[32];
+
+
+	memset(e, 0, sizeof e);
+	make_sfn(e, name);
+	e[11] = attr;
+	put16(e + 20, clust >> 16);
+	put32(e + 22, TIMESTAMP);
+	put16(e + 26, clust);
+	put32(e + 28, size);
+	put_entry(parent, e);
+}
+
+
+/* Builds an exFAT entry set: File, Stream extension and Name entries */
+static
+UINT make_set (
+	BYTE set[][32],
+	const char *name,
+	BYTE attr,
+	DWORD clust,
+	DWORD size,		/* ValidDataLength */
+	DWORD alloc,	/* DataLength, the allocated size */
+	BYTE nofat		/* The clusters are contiguous and have no FAT chain */
+)
+{
+	UINT len = (UINT)strlen(name), n = 2 + (len + 14) / 15, i;
+	WORD sum = 0, hash = 0, c;
+
+
+	memset(set, 0, n * 32);
+	set[0][0] = 0x85; set[0][1] = (BYTE)(n - 1);
+	set[0][4] = attr;
+	put32(set[0] + 8, TIMESTAMP); put32(set[0] + 12, TIMESTAMP); put32(set[0] + 16, TIMESTAMP);
+	set[1][0] = 0xC0; set[1][1] = nofat ? 3 : 1;	/* AllocationPossible, NoFatChain */
+	set[1][3] = (BYTE)len;
+	put32(set[1] + 8, size);
+	put32(set[1] + 20, clust);
+	put32(set[1] + 24, alloc);
+	for (i = 0; i < len; i++) {
+		c = (BYTE)name[i];
+		if (i % 15 == 0) set[2 + i / 15][0] = 0xC1;
+		put16(set[2 + i / 15] + 2 + i % 15 * 2, c);
+		if (c >= 'a' && c <= 'z') c -= 0x20;		/* The hash is taken on the up-cased name */
+		hash = (WORD)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF));
+		hash = (WORD)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8));
+	}
+	put16(set[1] + 4, hash);
+	for (i = 0; i < n * 32; i++) {
+		if (i != 2 && i != 3) sum = (WORD)(((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i / 32][i % 32]);
+	}
+	put16(set[0] + 2, sum);
+	return n;
+}
+
+
+static
+UINT add_set (
+	DWORD parent,
+	const char *name,
+	BYTE attr,
+	DWORD clust,
+	DWORD size,
+	DWORD alloc,
+	BYTE nofat
+)
+{
+	BYTE set[19][32];
+	UINT n, i, slot;
+
+
+	n = make_set(set, name, attr, clust, size, alloc, nofat);
+	slot = put_entry(parent, set[0]);
+	for (i = 1; i < n; i++) put_entry(parent, set[i]);
+	return slot;
+}
+
+
+
+static
+int create (
+	const char *path,
+	UINT clusterKB,
+	BYTE exfat
+)
+{
+	DWORD tsect;
+
+
+	Exfat = exfat;
+	Spc = clusterKB * 2;
+	FatSz = ((NUM_CLUSTERS + 2) * 4 + 511) / 512;
+	DataStart = RSVD_SECTORS + (exfat ? 1 : NUM_FATS) * FatSz;
+	tsect = DataStart + NUM_CLUSTERS * Spc;
+
+	Img = fopen(path, "w+b");
+	if (!Img) return 1;
+	if (ftruncate(fileno(Img), (off_t)tsect * 512)) return 1;	/* Sparse, unwritten sectors read as zeros */
+	free(Fat);
+	free(Used);
+	Fat = calloc(NUM_CLUSTERS + 2, sizeof *Fat);
+	Used = calloc((NUM_CLUSTERS + 7) / 8, 1);
+	if (!Fat || !Used) return 1;
+	Fat[0] = exfat ? 0xFFFFFFF8 : 0x0FFFFFF8; Fat[1] = exfat ? 0xFFFFFFFF : 0x0FFFFFFF;
+	NextFree = 2;
+
+	NumDirs = 1;
+	Dirs[0].first = Dirs[0].last = alloc_cluster(0);
+	Dirs[0].entries = 0;
+	return 0;
+}
+
+
+
+int fatimg_create (
+	const char *path,
+	UINT clusterKB
+)
+{
+	BYTE b[512];
+
+
+	if (create(path, clusterKB, 0)) return 1;
+	memset(b, 0, sizeof b);
+	b[0] = 0xEB; b[1] = 0x58; b[2] = 0x90;
+	memcpy(b + 3, "MSDOS5.0", 8);
+	put16(b + 11, 512);				/* BPB_BytsPerSec */
+	b[13] = (BYTE)Spc;				/* BPB_SecPerClus */
+	put16(b + 14, RSVD_SECTORS);	/* BPB_RsvdSecCnt */
+	b[16] = NUM_FATS;				/* BPB_NumFATs */
+	b[21] = 0xF8;					/* BPB_Media */
+	put32(b + 32, DataStart + NUM_CLUSTERS * Spc);	/* BPB_TotSec32 */
+	put32(b + 36, FatSz);			/* BPB_FATSz32 */
+	put32(b + 44, FATIMG_ROOT);		/* BPB_RootClus */
+	b[66] = 0x29;
+	memcpy(b + 71, "NO NAME    FAT32   ", 19);	/* BS_VolLab32, BS_FilSysType32 */
+	b[510] = 0x55; b[511] = 0xAA;
+	return write_at(0, 0, b, 512);
+}
+
+
+
+int fatimg_create_exfat (
+	const char *path,
+	UINT clusterKB
+)
+{
+	BYTE b[512], e[32];
+	DWORD sum = 0, upcase, c, n;
+	UINT i, j;
+
+
+	if (create(path, clusterKB, 1)) return 1;
+
+	/* Boot region: boot sector, 8 extended boot sectors, OEM parameters, reserved and checksum sectors */
+	for (i = 0; i < 11; i++) {
+		memset(b, 0, sizeof b);
+		if (i == 0) {
+			b[0] = 0xEB; b[1] = 0x76; b[2] = 0x90;
+			memcpy(b + 3, "EXFAT   ", 8);
+			put32(b + 72, DataStart + NUM_CLUSTERS * Spc);	/* VolumeLength */
+			put32(b + 80, RSVD_SECTORS);		/* FatOffset */
+			put32(b + 84, FatSz);				/* FatLength */
+			put32(b + 88, DataStart);			/* ClusterHeapOffset */
+			put32(b + 92, NUM_CLUSTERS);		/* ClusterCount */
+			put32(b + 96, FATIMG_ROOT);			/* FirstClusterOfRootDirectory */
+			put32(b + 100, 0x20170101);			/* VolumeSerialNumber */
+			put16(b + 104, 0x0100);				/* FileSystemRevision */
+			b[108] = 9;							/* BytesPerSectorShift */
+			for (n = Spc; n > 1; n >>= 1) b[109]++;	/* SectorsPerClusterShift */
+			b[110] = 1;							/* NumberOfFats */
+			b[111] = 0x80;						/* DriveSelect */
+		}
+		if (i < 9) { b[510] = 0x55; b[511] = 0xAA; }
+		for (j = 0; j < 512; j++) {
+			if (i == 0 && (j == 106 || j == 107 || j == 112)) continue;	/* VolumeFlags, PercentInUse */
+			sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + b[j];
+		}
+		if (write_at(i, 0, b, 512) || write_at(i + 12, 0, b, 512)) return 1;	/* Main and backup boot region */
+	}
+	for (j = 0; j < 512; j += 4) put32(b + j, sum);
+	if (write_at(11, 0, b, 512) || write_at(23, 0, b, 512)) return 1;
+
+	/* Allocation bitmap (written on close) and up-case table (ASCII only) after the root directory */
+	n = (NUM_CLUSTERS + 7) / 8;
+	Bitmap = NextFree;
+	for (c = 0, j = 0; j * Spc * 512 < n; j++) c = alloc_cluster(c);
+	upcase = alloc_cluster(0);
+	for (j = 0; j < 128; j++) put16(b + j * 2, j >= 'a' && j <= 'z' ? j - 0x20 : j);
+	for (sum = 0, j = 0; j < 256; j++) sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + b[j];
+	if (write_at(fatimg_sector(upcase), 0, b, 256)) return 1;
+
+	memset(e, 0, sizeof e);
+	e[0] = 0x83; e[1] = 2;				/* Volume label "SD" */
+	put16(e + 2, 'S'); put16(e + 4, 'D');
+	put_entry(FATIMG_ROOT, e);
+	memset(e, 0, sizeof e);
+	e[0] = 0x81;						/* Allocation bitmap */
+	put32(e + 20, Bitmap); put32(e + 24, n);
+	put_entry(FATIMG_ROOT, e);
+	memset(e, 0, sizeof e);
+	e[0] = 0x82;						/* Up-case table */
+	put32(e + 4, sum); put32(e + 20, upcase); put32(e + 24, 256);
+	put_entry(FATIMG_ROOT, e);
+	return 0;
+}
+
+
+
+DWORD fatimg_mkdir (
+	DWORD parent,
+	const char *name
+)
+{
+	IMGDIR *d;
+	DWORD c = alloc_cluster(0);
+
+
+	if (NumDirs == MAX_DIRS) {
+		fprintf(stderr, "fatimg: too many directories\n");
+		exit(2);
+	}
+	d = &Dirs[NumDirs++];
+	d->first = d->last = c;
+	d->entries = 0;
+	if (Exfat) {		/* No dot entries, the size is known on close */
+		d->parent = parent;
+		snprintf(d->name, sizeof d->name, "%s", name);
+		d->slot = add_set(parent, name, 0x10, c, Spc * 512, Spc * 512, 0);
+	} else {
+		add_entry(c, ".", 0x10, c, 0);
+		add_entry(c, "..", 0x10, parent == FATIMG_ROOT ? 0 : parent, 0);
+		add_entry(parent, name, 0x10, c, 0);
+	}
+	return c;
+}
+
+
+
+DWORD fatimg_add (
+	DWORD parent,
+	const char *name,
+	const void *data,
+	DWORD size,
+	UINT frag
+)
+{
+	DWORD bpc = Spc * 512, n, c = 0, first = 0, ofs;
+
+
+	for (n = 0; n * bpc < size; n++) {
+		if (frag && n && n % frag == 0) NextFree++;	/* Leave a free cluster, the chain jumps over it */
+		c = alloc_cluster(c);
+		if (!first) first = c;
+		if (data) {
+			ofs = n * bpc;
+			write_at(fatimg_sector(c), 0, (const BYTE*)data + ofs, (UINT)(size - ofs < bpc ? size - ofs : bpc));
+		}
+	}
+	if (Exfat) {
+		if (!frag) {		/* Contiguous, no FAT chain (NoFatChain) */
+			for (c = first; c && c < first + n; c++) Fat[c] = 0;
+		}
+		add_set(parent, name, 0x20, first, size, n * bpc, !frag);
+	} else {
+		add_entry(parent, name, 0x20, first, size);
+	}
+	return first;
+}
+
+
+
+int fatimg_close (void)
+{
+	BYTE set[19][32];
+	UINT i, j, n, len;
+	int r = 0;
+
+
+	if (Exfat) {
+		for (i = 1; i < NumDirs; i++) {		/* Directory sizes */
+			for (len = 0, j = Dirs[i].first; j; j = Fat[j] < NUM_CLUSTERS + 2 ? Fat[j] : 0) len++;
+			n = make_set(set, Dirs[i].name, 0x10, Dirs[i].first, len * Spc * 512, len * Spc * 512, 0);
+			for (j = 0; j < n; j++) r |= write_entry(find_dir(Dirs[i].parent), Dirs[i].slot + j, set[j]);
+		}
+		for (i = 0; i * Spc * 512 < (NUM_CLUSTERS + 7) / 8; i++) {
+			n = (NUM_CLUSTERS + 7) / 8 - i * Spc * 512;
+			r |= write_at(fatimg_sector(Bitmap + i), 0, Used + i * Spc * 512, n < Spc * 512 ? n : Spc * 512);
+		}
+	}
+	for (i = 0; i < (Exfat ? 1 : NUM_FATS); i++) {
+		if (fseek(Img, (long)(RSVD_SECTORS + i * FatSz) * 512, SEEK_SET)
+			|| fwrite(Fat, sizeof *Fat, NUM_CLUSTERS + 2, Img) != NUM_CLUSTERS + 2) r = 1;
+	}
+	if (fclose(Img)) r = 1;
+	Img = 0;
+	free(Fat);
+	free(Used);
+	Fat = 0;
+	Used = 0;
+	return r;
+}
+
+
+
+DWORD fatimg_wav (
+	BYTE *buf,
+	DWORD rate,
+	BYTE channels,
+	BYTE bits,
+	DWORD listSize,
+	DWORD dataSize,
+	BYTE seed
+)
+{
+	DWORD n = 12, i, al = channels * bits / 8;
+
+
+	memcpy(buf + n, "fmt ", 4); put32(buf + n + 4, 16);
+	put16(buf + n + 8, 1);				/* LPCM */
+	put16(buf + n + 10, channels);
+	put32(buf + n + 12, rate);
+	put32(buf + n + 16, rate * al);
+	put16(buf + n + 20, al);
+	put16(buf + n + 22, bits);
+	n += 24;
+	if (listSize) {
+		memcpy(buf + n, "LIST", 4); put32(buf + n + 4, listSize);
+		memset(buf + n + 8, 'x', listSize);
+		n += 8 + listSize;
+	}
+	memcpy(buf + n, "data", 4); put32(buf + n + 4, dataSize);
+	n += 8;
+	for (i = 0; i < dataSize; i++) buf[n + i] = (BYTE)(i + seed);
+	n += dataSize;
+	memcpy(buf, "RIFF", 4); put32(buf + 4, n - 8);
+	memcpy(buf + 8, "WAVE", 4);
+	return n;
+}
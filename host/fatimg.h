@@ -0,0 +1,34 @@
+/*-----------------------------------------------------------------------
+/  FAT32 and exFAT image builder for the host tests and benchmarks
+/-----------------------------------------------------------------------*/
+
+#ifndef _FATIMG_DEFINED
+#define _FATIMG_DEFINED
+
+#include "integer.h"
+
+/* Builds a FAT32 volume (no partition table) into a sparse image file. Files
+/  and directories are allocated in order from cluster 3 on. A fragmented file
+/  leaves one free cluster after every frag clusters, so its chain has a jump
+/  there. Directories are referred to by their start cluster, FATIMG_ROOT is
+/  the root directory. Names are given as "NAME.EXT".
+/  On exFAT, the root directory is followed by the allocation bitmap and the
+/  up-case table. A file that is not fragmented is marked NoFatChain and gets
+/  no FAT entries, and its DataLength is rounded up to whole clusters while
+/  ValidDataLength is the file size. */
+
+#define FATIMG_ROOT	2
+
+int fatimg_create (const char *path, UINT clusterKB);		/* 0 if OK */
+int fatimg_create_exfat (const char *path, UINT clusterKB);	/* 0 if OK */
+DWORD fatimg_mkdir (DWORD parent, const char *name);		/* Returns the start cluster of the new directory */
+DWORD fatimg_add (DWORD parent, const char *name, const void *data, DWORD size, UINT frag);	/* Returns the start cluster of the file */
+DWORD fatimg_sector (DWORD clust);							/* First sector of a cluster */
+int fatimg_close (void);									/* Writes the FAT, 0 if OK */
+
+/* Builds a WAV file into buf: a RIFF header, fmt, a LIST chunk of listSize
+/  bytes if listSize is not 0, and a data chunk of dataSize bytes. The data
+/  bytes are (offset in the data + seed) & 0xFF. Returns the file size. */
+DWORD fatimg_wav (BYTE *buf, DWORD rate, BYTE channels, BYTE bits, DWORD listSize, DWORD dataSize, BYTE seed);
+
+#endif	/* _FATIMG_DEFINED */
@@ -0,0 +1,77 @@
+/*----------------------------------------------------------------------------/
+/  Hardware abstraction of the player on the host (see sim.h)
+/----------------------------------------------------------------------------*/
+
+#ifndef _HAL_HOST_DEFINED
+#define _HAL_HOST_DEFINED
+
+#include <stdint.h>
+#include "integer.h"
+#include "sim.h"
+
+#if FIFO_IN_GPIOR
+#error The host build keeps the FIFO indexes in memory
+#endif
+
+void delay_ms (WORD);	/* Defined in sim.c */
+void delay_us (WORD);	/* Defined in sim.c */
+
+static inline void hal_init (void) {
+}
+
+static inline void hal_adc_init (void) {
+	sim_adc_start();
+}
+
+static inline void hal_adc_start (void) {
+	sim_adc_start();
+}
+
+static inline unsigned char hal_adc_value (void) {
+	return sim_button_voltage();
+}
+
+static inline void hal_tick_start (void) {
+	sim_tick_start();
+}
+
+static inline void hal_dac_write (unsigned char a, unsigned char b) {
+	(void)a; (void)b;
+}
+
+static inline void hal_pwm_start (void) {
+}
+
+static inline void hal_pwm_stop (void) {
+}
+
+static inline void hal_audio_timer_start (void) {
+	sim_audio_timer(1);
+}
+
+static inline void hal_audio_timer_stop (void) {
+	sim_audio_timer(0);
+}
+
+static inline unsigned char hal_audio_timer_running (void) {
+	return sim_audio_timer_running();
+}
+
+static inline void hal_audio_timer_period (unsigned char period) {
+	sim_audio_period(period);
+}
+
+static inline unsigned char hal_audio_timer_get_period (void) {
+	return sim_audio_get_period();
+}
+
+static inline void hal_led_shift (uint16_t states) {
+	(void)states;
+	sim_advance(16 * 20);
+}
+
+static inline void hal_spin (void) {
+	sim_advance(8);
+}
+
+#endif	/* _HAL_HOST_DEFINED */
@@ -0,0 +1,269 @@
+/*-----------------------------------------------------------------------*/
+/* Player simulation: main.c on the host against a disk image            */
+/*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "pff.h"
+#include "diskimg.h"
+#include "sim.h"
+
+#ifndef FIFO_SAMPLES
+#define FIFO_SAMPLES	128		/* Must match main.c */
+#endif
+
+/* Cycles per sample of the forwarding kernels in MODE 1, see asmfunc.S */
+#define MONO8_CYCLES	45
+#define STEREO8_CYCLES	62
+#define MONO16_CYCLES	62
+#define STEREO16_CYCLES	96
+
+/* Defined in main.c */
+int player_main (void);
+void WDT_vect (void);
+void ADC_vect (void);
+extern volatile unsigned char FifoRi, FifoWi;
+extern unsigned char Buff[FIFO_SAMPLES * 2];
+extern void (*FwdKernel)(void);
+#if FIFO_STATS
+extern volatile uint16_t FifoUnderruns;
+#endif
+
+uint8_t SREG;
+const UINT SimFifoSamples = FIFO_SAMPLES;
+
+static const SIM_SETUP *Setup;
+static SIM_RESULT Result;
+static FILE *Pcm;
+static jmp_buf Exit;
+static unsigned long long Now;			/* Simulated time in cycles */
+static unsigned long long Limit;
+static unsigned long long NextSample;	/* Time of the next audio ISR */
+static unsigned long long NextTick;		/* Time of the next watchdog ISR, 0:Not running */
+static unsigned long long NextAdc;		/* Time of the next ADC ISR, 0:No conversion running */
+static BYTE TimerOn, Period = 0xFF;
+static BYTE Playing;					/* A sample was output since the timer started */
+static DWORD Pending;					/* Sample periods without a sample since the last one */
+
+
+/* The forwarding kernels of asmfunc.S, only their addresses are used to tell the format */
+void fwd_mono8 (void) {}
+void fwd_stereo8 (void) {}
+void fwd_mono16 (void) {}
+void fwd_stereo16 (void) {}
+
+
+static
+void audio_isr (void)
+{
+	BYTE ri = FifoRi;
+
+
+	if (ri == FifoWi) {				/* FIFO empty */
+#if FIFO_STATS
+		FifoUnderruns++;
+#endif
+		if (Playing) Pending++;
+		return;
+	}
+	if (Pcm) {						/* Left (OCR1B) and right (OCR1A) byte */
+		putc(Buff[ri * 2 + 1], Pcm);
+		putc(Buff[ri * 2], Pcm);
+	}
+	FifoRi = (ri + 1 == FIFO_SAMPLES) ? 0 : ri + 1;
+	if (!Result.samples++) Result.startMs = (DWORD)(Now / 16000);
+	Playing = 1;
+	if (Pending) {
+		Result.underruns += Pending;
+		Result.gaps++;
+		if (Pending > Result.longestGap) Result.longestGap = Pending;
+		Pending = 0;
+	}
+}
+
+
+static
+void finish (void)
+{
+	Result.ms = (DWORD)(Now / 16000);
+	Result.period = Period;
+	longjmp(Exit, 1);
+}
+
+
+void sim_advance (
+	DWORD cycles
+)
+{
+	Now += cycles;
+	for (;;) {
+		if (TimerOn && NextSample <= Now && (!NextTick || NextSample <= NextTick) && (!NextAdc || NextSample <= NextAdc)) {
+			audio_isr();
+			NextSample += (Period + 1) * 8UL;	/* TC0 runs at 2 MHz */
+			Now += SIM_ISR_CYCLES;
+		} else if (NextTick && NextTick <= Now && (!NextAdc || NextTick <= NextAdc)) {
+			WDT_vect();
+			NextTick += SIM_TICK_CYCLES;
+			Now += 20;
+		} else if (NextAdc && NextAdc <= Now) {
+			NextAdc = 0;
+			ADC_vect();
+			Now += 40;
+		} else {
+			break;
+		}
+	}
+	if (Now >= Limit) finish();
+}
+
+
+void sim_audio_timer (
+	BYTE on
+)
+{
+	if (on && !TimerOn) NextSample = Now + (Period + 1) * 8UL;
+	if (!on && TimerOn && Playing) {
+		Result.stopped = 1;
+		if (Setup->untilStop) {
+			TimerOn = 0;
+			finish();
+		}
+	}
+	TimerOn = on;
+	Playing = 0;
+	Pending = 0;
+}
+
+
+BYTE sim_audio_timer_running (void)
+{
+	return TimerOn;
+}
+
+
+void sim_audio_period (
+	BYTE period
+)
+{
+	Period = period;
+}
+
+
+BYTE sim_audio_get_period (void)
+{
+	return Period;
+}
+
+
+void sim_tick_start (void)
+{
+	NextTick = Now + SIM_TICK_CYCLES;
+}
+
+
+void sim_adc_start (void)
+{
+	if (!NextAdc) NextAdc = Now + SIM_ADC_CYCLES;
+}
+
+
+BYTE sim_button_voltage (void)
+{
+	static const BYTE level[12] = {0, 11, 21, 33, 51, 76, 109, 142, 170, 195, 215, 240};	/* Middle of the ranges of buttonPressed() */
+	BYTE button = 0;
+	DWORD ms = (DWORD)(Now / 16000);
+	UINT i;
+
+
+	for (i = 0; i < Setup->nbuttons && Setup->buttons[i].ms <= ms; i++) button = Setup->buttons[i].button;
+	return level[button];
+}
+
+
+void delay_ms (
+	WORD ms
+)
+{
+	while (ms--) sim_advance(16000);
+}
+
+
+void delay_us (
+	WORD us
+)
+{
+	sim_advance(us * 16UL);
+}
+
+
+/* Puts the bytes disk_readp() forwards into the FIFO like the kernel in FwdKernel */
+static
+void forward_wave (
+	const BYTE *data,
+	UINT count
+)
+{
+	UINT size, cycles;
+	BYTE l, r, wi;
+
+
+	if (FwdKernel == fwd_mono8) { size = 1; cycles = MONO8_CYCLES; }
+	else if (FwdKernel == fwd_stereo8) { size = 2; cycles = STEREO8_CYCLES; }
+	else if (FwdKernel == fwd_mono16) { size = 2; cycles = MONO16_CYCLES; }
+	else { size = 4; cycles = STEREO16_CYCLES; }
+
+	for (; count >= size; count -= size, data += size) {
+		switch (size) {
+		case 1: l = r = data[0]; break;
+		case 2: if (FwdKernel == fwd_stereo8) { l = data[0]; r = data[1]; } else { l = r = data[1] - 0x80; } break;
+		default: l = data[1] - 0x80; r = data[3] - 0x80; break;
+		}
+		wi = (FifoWi + 1 == FIFO_SAMPLES) ? 0 : FifoWi + 1;
+		while (wi == FifoRi) {			/* Wait while the FIFO is full */
+			sim_advance(TimerOn && NextSample > Now ? (DWORD)(NextSample - Now) : 8);
+		}
+		Buff[FifoWi * 2] = r;
+		Buff[FifoWi * 2 + 1] = l;
+		FifoWi = wi;
+		sim_advance(cycles);
+	}
+}
+
+
+int sim_run (
+	const SIM_SETUP *setup,
+	SIM_RESULT *result
+)
+{
+	int fd[2], status, short_read;
+	pid_t pid;
+
+
+	memset(result, 0, sizeof *result);
+	if (pipe(fd)) return 1;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) return 1;
+	if (!pid) {						/* Child, runs the player with a fresh main.c state */
+		close(fd[0]);
+		Setup = setup;
+		Limit = (unsigned long long)setup->limitMs * 16000;
+		Pcm = setup->pcm ? fopen(setup->pcm, "wb") : 0;
+		diskImgWave = forward_wave;
+		diskImgClock = sim_advance;
+		diskImgLatency = setup->latency;
+		if (diskimg_open(setup->image)) _exit(2);
+		if (!setjmp(Exit)) player_main();
+		if (Pcm) fclose(Pcm);
+		if (write(fd[1], &Result, sizeof Result) != sizeof Result) _exit(3);
+		_exit(0);
+	}
+	close(fd[1]);
+	short_read = read(fd[0], result, sizeof *result) != sizeof *result;
+	close(fd[0]);
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) return 1;
+	return short_read;
+}
@@ -0,0 +1,63 @@
+/*-----------------------------------------------------------------------
+/  Player simulation: main.c on the host against a disk image
+/-----------------------------------------------------------------------*/
+
+#ifndef _SIM_DEFINED
+#define _SIM_DEFINED
+
+#include "integer.h"
+#include "diskimg.h"
+
+/* main.c is built with -Dmain=player_main -DHAL_HOST=1 and runs in a child
+/  process on a simulated 16 MHz clock. The clock advances by what the card
+/  transfers (diskimg.c), the forwarding kernels, the delays and the busy waits
+/  would take on the target, the rest of the C code is taken as free. The audio
+/  ISR and the watchdog tick run at their simulated times. The output is the
+/  stream of samples the audio ISR sends to the PWM DAC. */
+
+#define SIM_CLOCK		16000000UL
+#define SIM_ISR_CYCLES	52					/* Audio ISR, see the budget table in asmfunc.S */
+#define SIM_TICK_CYCLES	(16 * 16000UL)		/* Watchdog interrupt period (16 ms) */
+#define SIM_ADC_CYCLES	(13 * 128UL)		/* Button conversion, 13 clocks of the ADC at prescaler 128 */
+
+extern const UINT SimFifoSamples;	/* FIFO depth main.c is built with */
+
+typedef struct {
+	DWORD	ms;			/* Simulated time of the change */
+	BYTE	button;		/* Button held from then on (1..11), 0:Released */
+} SIM_BUTTON;
+
+typedef struct {
+	const char	*image;			/* Disk image to play from */
+	const char	*pcm;			/* File to write the output samples to (left and right byte), NULL:None */
+	const SIM_BUTTON *buttons;	/* Button script, in time order */
+	UINT		nbuttons;
+	DWORD		limitMs;		/* Simulated time to run at most */
+	BYTE		untilStop;		/* Not 0: End when the audio timer stops after a playback */
+	const DISKIMG_LATENCY *latency;	/* Latency model of the card, NULL:None (see diskimg.h) */
+} SIM_SETUP;
+
+typedef struct {
+	DWORD	ms;			/* Simulated time at the end */
+	DWORD	startMs;	/* Time the first sample was output */
+	DWORD	samples;	/* Samples output */
+	DWORD	underruns;	/* Sample periods without a sample in the middle of a playback */
+	DWORD	gaps;		/* Runs of such sample periods */
+	DWORD	longestGap;	/* Longest run, in sample periods */
+	BYTE	period;		/* Last sampling period (OCR0A) */
+	BYTE	stopped;	/* Not 0 if the audio timer was stopped after a playback */
+} SIM_RESULT;
+
+int sim_run (const SIM_SETUP *setup, SIM_RESULT *result);	/* Runs the player in a child process, 0 if OK */
+
+/* Used by hal_host.h */
+void sim_advance (DWORD cycles);
+void sim_audio_timer (BYTE on);
+BYTE sim_audio_timer_running (void);
+void sim_audio_period (BYTE period);
+BYTE sim_audio_get_period (void);
+BYTE sim_button_voltage (void);
+void sim_tick_start (void);
+void sim_adc_start (void);
+
+#endif	/* _SIM_DEFINED */
@@ -0,0 +1,172 @@
+/*-----------------------------------------------------------------------*/
+/* Card latency stress: the player on cards of several latency profiles  */
+/*-----------------------------------------------------------------------*/
+
+/* Plays a playlist of three tracks on every profile, at 44.1 kHz 16 bit
+/  stereo (the highest data rate) and at 22.05 kHz 8 bit stereo, and prints
+/  the gaps in the output and whether the FIFO survived the card. Every
+/  STATS.DAT given on the command line is replayed as a profile too, from its
+/  "LATE" section. The latency draws start from a fixed seed, so the output
+/  is the same on every run.
+/
+/  With -max, it finds the longest data token and block wait the FIFO depth
+/  it is built with survives on a single track instead, see "make sweep". */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diskimg.h"
+#include "fatimg.h"
+#include "sim.h"
+
+#define IMAGE	"build/stress.img"
+#define SECONDS	2			/* Length of a track */
+#define TRACES	8			/* STATS.DAT files replayed at most */
+
+static const DISKIMG_LATENCY Profiles[] = {
+	/* name				token			block		busy			gc */
+	{"fast",			50, 200,		10, 50,		500, 1500,		0, 0,			0},
+	{"typical",			100, 800,		20, 200,	1000, 3000,		4096, 20000,	0},
+	{"slow token",		1000, 4000,		200, 1500,	1000, 3000,		0, 0,			0},
+	{"gc stalls",		100, 800,		20, 200,	1000, 3000,		512, 50000,		0},
+	{"slow writes",		100, 800,		20, 200,	20000, 250000,	0, 0,			0},
+};
+
+static BYTE Wav[44100 * 4 * SECONDS + 1024];
+static WORD Late[TRACES][DISKIMG_LATE_CLASSES * 2];
+static DISKIMG_LATENCY Traces[TRACES];
+
+
+/* Loads the "LATE" section of a STATS.DAT, 0 if OK */
+static int load_trace (const char *path, WORD *late)
+{
+	static BYTE buf[4096];
+	FILE *f = fopen(path, "rb");
+	size_t n, i, c;
+
+
+	if (!f) return 1;
+	n = fread(buf, 1, sizeof buf, f);
+	fclose(f);
+	for (i = 0; i + 4 + DISKIMG_LATE_CLASSES * 4 <= n; i++) {
+		if (!memcmp(&buf[i], "LATE", 4)) {
+			for (c = 0; c < DISKIMG_LATE_CLASSES * 2; c++) late[c] = (WORD)(buf[i + 4 + c * 2] | buf[i + 5 + c * 2] << 8);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static void build_image (DWORD rate, BYTE bits, UINT tracks)
+{
+	static const BYTE position[3] = {1, 1, 0};
+	static BYTE zeros[60416];
+	char name[13];
+	DWORD size;
+	UINT i;
+
+
+	if (fatimg_create(IMAGE, 32)) exit(2);
+	fatimg_add(FATIMG_ROOT, "POSITION.DAT", position, sizeof position, 0);
+	fatimg_add(FATIMG_ROOT, "INDEX.DAT", zeros, sizeof zeros, 0);
+	for (i = 0; i < tracks; i++) {
+		size = fatimg_wav(Wav, rate, 2, bits, 0, rate * 2 * bits / 8 * SECONDS, (BYTE)(i * 50));
+		sprintf(name, "10%u.WAV", i + 1);
+		fatimg_add(FATIMG_ROOT, name, Wav, size, 0);
+	}
+	if (fatimg_close()) exit(2);
+}
+
+
+/* Plays the playlist from a fresh image, the player writes its position to it */
+static void play (const DISKIMG_LATENCY *latency, DWORD rate, BYTE bits, UINT tracks, SIM_RESULT *res)
+{
+	SIM_SETUP setup;
+
+
+	build_image(rate, bits, tracks);
+	memset(&setup, 0, sizeof setup);
+	setup.image = IMAGE;
+	setup.limitMs = 60000;
+	setup.untilStop = 1;
+	setup.latency = latency;
+	if (sim_run(&setup, res) || res->samples != tracks * rate * SECONDS) {
+		printf("stress: the simulation failed\n");
+		exit(1);
+	}
+}
+
+
+static void run (const DISKIMG_LATENCY *latency, const char *format, DWORD rate, BYTE bits)
+{
+	SIM_RESULT res;
+
+
+	play(latency, rate, bits, 3, &res);
+	printf("%-24s %-14s samples %7lu  gaps %4lu  underruns %7lu  longest %6.1f ms  %s\n",
+		latency ? latency->name : "none", format,
+		(unsigned long)res.samples, (unsigned long)res.gaps, (unsigned long)res.underruns,
+		res.longestGap * 1000.0 / rate, res.underruns ? "UNDERRUN" : "ok");
+}
+
+
+/* Finds the longest data token and block wait the FIFO survives while a track
+/  plays, to 10 us. The card is as fast as the ranges of "fast" otherwise. */
+static DWORD max_latency (DWORD rate, BYTE bits)
+{
+	DISKIMG_LATENCY m = Profiles[0];
+	SIM_RESULT res;
+	DWORD lo = 0, hi = 20000, mid;		/* The FIFO survives lo, not hi */
+
+
+	for (;;) {
+		mid = (lo + hi) / 2;
+		m.tokenMin = m.tokenMax = m.blockMin = m.blockMax = lo;
+		play(&m, rate, bits, 1, &res);
+		if (res.underruns) return 0;
+		if (hi - lo <= 10) return lo;
+		m.tokenMin = m.tokenMax = m.blockMin = m.blockMax = mid;
+		play(&m, rate, bits, 1, &res);
+		if (res.underruns) hi = mid; else lo = mid;
+	}
+}
+
+
+int main (int argc, char *argv[])
+{
+	static const struct { DWORD rate; BYTE bits; const char *name; } formats[] = {
+		{44100, 16, "44.1k 16 bit"},
+		{22050, 8, "22.05k 8 bit"}
+	};
+	UINT f, p, ntraces = 0;
+	int i;
+
+
+	if (argc > 1 && !strcmp(argv[1], "-max")) {
+		printf("FIFO %3u samples (%4.2f ms at 44.1 kHz)  longest card wait: %5lu us at %s, %5lu us at %s\n",
+			SimFifoSamples, (SimFifoSamples - 1) * 1000.0 / 44100,
+			(unsigned long)max_latency(formats[0].rate, formats[0].bits), formats[0].name,
+			(unsigned long)max_latency(formats[1].rate, formats[1].bits), formats[1].name);
+		remove(IMAGE);
+		return 0;
+	}
+	for (i = 1; i < argc && ntraces < TRACES; i++) {
+		if (load_trace(argv[i], Late[ntraces])) {
+			printf("stress: no LATE section in %s\n", argv[i]);
+			return 1;
+		}
+		Traces[ntraces].name = argv[i];
+		Traces[ntraces].late = Late[ntraces];
+		ntraces++;
+	}
+
+	printf("FIFO %u samples\n", SimFifoSamples);
+	for (f = 0; f < 2; f++) {
+		run(0, formats[f].name, formats[f].rate, formats[f].bits);
+		for (p = 0; p < sizeof Profiles / sizeof Profiles[0]; p++) run(&Profiles[p], formats[f].name, formats[f].rate, formats[f].bits);
+		for (p = 0; p < ntraces; p++) run(&Traces[p], formats[f].name, formats[f].rate, formats[f].bits);
+	}
+	remove(IMAGE);
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*-----------------------------------------------------------------------*/
+/* pff tests on FAT32 images, or exFAT images if built with _FS_EXFAT   */
+/*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pff.h"
+#include "diskimg.h"
+#include "fatimg.h"
+
+#if _FS_EXFAT
+#define NAME	"test_pff_exfat"
+#else
+#define NAME	"test_pff"
+#endif
+#define IMAGE	"build/" NAME ".img"
+
+static FATFS Fs;
+static int Failed;
+
+#define CHECK(c)	do { if (!(c)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #c); Failed = 1; } } while (0)
+
+
+static BYTE pattern (DWORD ofs, BYTE seed)
+{
+	return (BYTE)(ofs * 7 + (ofs >> 9) + seed);
+}
+
+
+static void fill (BYTE *buf, DWORD size, BYTE seed)
+{
+	DWORD i;
+
+
+	for (i = 0; i < size; i++) buf[i] = pattern(i, seed);
+}
+
+
+/* Reads the open file from ofs to its end in odd pieces and compares it */
+static int verify_from (DWORD ofs, BYTE seed)
+{
+	BYTE buf[333];
+	UINT br, i;
+
+
+	if (pf_lseek(ofs) != FR_OK) return 0;
+	do {
+		if (pf_read(buf, sizeof buf, &br) != FR_OK) return 0;
+		for (i = 0; i < br; i++, ofs++) {
+			if (buf[i] != pattern(ofs, seed)) return 0;
+		}
+	} while (br == sizeof buf);
+	return ofs == Fs.fsize;
+}
+
+
+static void build_image (void)
+{
+	static BYTE data[300 * 1024];
+	char name[13];
+	DWORD dir;
+	UINT i;
+
+
+	if (_FS_EXFAT ? fatimg_create_exfat(IMAGE, 4) : fatimg_create(IMAGE, 4)) exit(2);
+	fill(data, sizeof data, 1);
+	fatimg_add(FATIMG_ROOT, "CONTIG.DAT", data, sizeof data, 0);
+	fill(data, sizeof data, 2);
+	fatimg_add(FATIMG_ROOT, "FRAG.DAT", data, sizeof data, 3);
+	fatimg_add(FATIMG_ROOT, "LONG.DAT", 0, 2UL << 20, 0);		/* 512 contiguous clusters, 4 FAT sectors */
+	for (i = 0; i < 150; i++) {			/* A root directory of several clusters */
+		sprintf(name, "F%03u.TXT", i);
+		fatimg_add(FATIMG_ROOT, name, "x", 1, 0);
+	}
+	fatimg_add(FATIMG_ROOT, "lower.dat", "x", 1, 0);
+	if (_FS_EXFAT) fatimg_add(FATIMG_ROOT, "TOOLONGNAME.DAT", "x", 1, 0);	/* Not an 8.3 name, not visible */
+	dir = fatimg_mkdir(FATIMG_ROOT, "1");
+	fill(data, 5000, 3);
+	fatimg_add(dir, "001.WAV", data, 5000, 0);
+	if (fatimg_close()) exit(2);
+}
+
+
+static void test_read (void)
+{
+	CHECK(pf_open("CONTIG.DAT") == FR_OK);
+	CHECK(verify_from(0, 1));
+	CHECK(pf_open("FRAG.DAT") == FR_OK);
+	CHECK(verify_from(0, 2));
+}
+
+
+static void test_seek (void)
+{
+	static const DWORD ofs[] = {100000, 5, 4096, 4095, 307199, 200000, 12288, 0, 150001};
+	UINT i;
+
+
+	CHECK(pf_open("FRAG.DAT") == FR_OK);
+	for (i = 0; i < sizeof ofs / sizeof ofs[0]; i++) {
+		CHECK(verify_from(ofs[i], 2));
+	}
+}
+
+
+/* Streaming must not follow the chain further than one FAT sector at a time,
+/  the FIFO drains while the run is walked. A NoFatChain file on exFAT reads
+/  no FAT at all */
+static void test_stream_walk (void)
+{
+	DWORD fwd;
+	UINT br, most = 0;
+
+
+	CHECK(pf_open("LONG.DAT") == FR_OK);
+	do {
+		fwd = diskImgStats.forwardp;
+		CHECK(pf_read(0, 512, &br) == FR_OK);
+		if (diskImgStats.forwardp - fwd > most) most = diskImgStats.forwardp - fwd;
+	} while (br == 512);
+	CHECK(Fs.fptr == Fs.fsize);
+	CHECK(most == ((Fs.flag & FA_NOFAT) ? 0 : 1));
+}
+
+
+static UINT StopAt, Fed;
+
+static BYTE stop_at (BYTE b)
+{
+	return ++Fed != StopAt;
+}
+
+
+/* A stop on the last byte of a sector ends pf_forward() there, not a sector later */
+static void test_forward_stop (void)
+{
+	UINT bf;
+
+
+	CHECK(pf_open("CONTIG.DAT") == FR_OK && pf_lseek(100) == FR_OK);
+	Fed = 0; StopAt = 412;
+	CHECK(pf_forward(stop_at, 1000, &bf) == FR_OK);
+	CHECK(bf == 412 && Fed == 412 && Fs.fptr == 512);
+	Fed = 0; StopAt = 3;
+	CHECK(pf_forward(stop_at, 1000, &bf) == FR_OK);
+	CHECK(bf == 3 && Fs.fptr == 515);
+	Fed = 0; StopAt = 0;
+	CHECK(pf_forward(stop_at, 1000, &bf) == FR_OK);
+	CHECK(bf == 1000 && Fs.fptr == 1515 && verify_from(1515, 1));
+}
+
+
+static void test_dir (void)
+{
+	DIR dj;
+	FILINFO fno;
+	UINT n = 0;
+
+
+	CHECK(pf_open("F149.TXT") == FR_OK);
+	CHECK(pf_open("F150.TXT") == FR_NO_FILE);
+	CHECK(pf_opendir(&dj, "") == FR_OK);
+	while (pf_readdir(&dj, &fno) == FR_OK && fno.fname[0]) n++;
+	CHECK(n == 155);
+	CHECK(pf_opendir(&dj, "1") == FR_OK);
+	CHECK(pf_openin(dj.sclust, "001.WAV") == FR_OK && verify_from(0, 3));
+	CHECK(pf_open("1/001.WAV") == FR_OK && Fs.fsize == 5000);
+	CHECK(pf_openin(dj.sclust, "CONTIG.DAT") == FR_NO_FILE);
+	CHECK(pf_open("LOWER.DAT") == FR_OK && Fs.fsize == 1);
+}
+
+
+#if _FS_EXFAT
+/* Contiguous files are read without the FAT (their FAT entries are left 0),
+/  the others follow their chain */
+static void test_exfat (void)
+{
+	DWORD fwd;
+	UINT br, most = 0;
+
+
+	CHECK(Fs.fs_type == FS_EXFAT);
+	CHECK(pf_open("CONTIG.DAT") == FR_OK && (Fs.flag & FA_NOFAT));
+	CHECK(verify_from(250000, 1) && verify_from(4095, 1));
+	CHECK(pf_open("FRAG.DAT") == FR_OK && !(Fs.flag & FA_NOFAT));
+	do {
+		fwd = diskImgStats.forwardp;
+		CHECK(pf_read(0, 512, &br) == FR_OK);
+		if (diskImgStats.forwardp - fwd > most) most = diskImgStats.forwardp - fwd;
+	} while (br == 512);
+	CHECK(Fs.fptr == 300 * 1024 && most == 1);
+	CHECK(pf_open("TOOLONGNAME.DAT") == FR_NO_FILE);
+	CHECK(pf_open("1/001.WAV") == FR_OK && (Fs.flag & FA_NOFAT) && Fs.fsize == 5000);	/* ValidDataLength, not the cluster */
+}
+#endif
+
+
+int main (void)
+{
+	build_image();
+	if (diskimg_open(IMAGE) || pf_mount(&Fs) != FR_OK) {
+		printf("%s: can't mount the image\n", NAME);
+		return 1;
+	}
+	test_read();
+	test_seek();
+	test_stream_walk();
+	test_forward_stop();
+	test_dir();
+#if _FS_EXFAT
+	test_exfat();
+#endif
+	diskimg_close();
+	remove(IMAGE);
+	printf("%s: %s\n", NAME, Failed ? "FAILED" : "OK");
+	return Failed;
+}
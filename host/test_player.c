@@ -0,0 +1,278 @@
+/*-----------------------------------------------------------------------*/
+/* Player tests: main.c in the simulation (sim.h) on FAT32 images        */
+/*-----------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diskimg.h"
+#include "fatimg.h"
+#include "sim.h"
+
+#define IMAGE	"build/test_player.img"
+#define PCM		"build/test_player.pcm"
+
+static int Failed;
+static BYTE Wav[3][200 * 1024];		/* Track files */
+static DWORD WavSize[3];
+
+#define CHECK(c)	do { if (!(c)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #c); Failed = 1; } } while (0)
+
+
+/* Builds 101.WAV..103.WAV with a LIST chunk of list bytes before the data (0:None),
+/  POSITION.DAT pointing to track 1 of channel 1 and, if index is set, an empty INDEX.DAT */
+static void build_image (int index, DWORD rate, BYTE bits, DWORD list, DWORD samples)
+{
+	static const BYTE position[3] = {1, 1, 0};
+	static BYTE zeros[60416];
+	char name[13];
+	UINT i;
+
+
+	if (fatimg_create(IMAGE, 4)) exit(2);
+	fatimg_add(FATIMG_ROOT, "POSITION.DAT", position, sizeof position, 0);
+	if (index) fatimg_add(FATIMG_ROOT, "INDEX.DAT", zeros, sizeof zeros, 0);
+	for (i = 0; i < 3; i++) {
+		WavSize[i] = fatimg_wav(Wav[i], rate, 2, bits, list, samples * 2 * bits / 8, (BYTE)(i * 50));
+		sprintf(name, "10%u.WAV", i + 1);
+		fatimg_add(FATIMG_ROOT, name, Wav[i], WavSize[i], 0);
+	}
+	if (fatimg_close()) exit(2);
+}
+
+
+/* Checks that the output is the data of the three tracks, one after the other */
+static int pcm_matches (DWORD dataOffset, BYTE bits)
+{
+	FILE *f = fopen(PCM, "rb");
+	DWORD i, n;
+	int c, ok = 1;
+	UINT t;
+
+
+	if (!f) return 0;
+	for (t = 0; t < 3 && ok; t++) {
+		n = WavSize[t] - dataOffset;
+		for (i = 0; i < n && ok; i += bits / 8) {
+			c = getc(f);
+			if (bits == 8) ok = (c == Wav[t][dataOffset + i]);
+			else ok = (c == (BYTE)(Wav[t][dataOffset + i + 1] - 0x80));	/* MSB, offset binary */
+		}
+	}
+	if (ok) ok = (getc(f) == EOF);
+	fclose(f);
+	return ok;
+}
+
+
+static void run_on (const char *name, const DISKIMG_LATENCY *latency, const SIM_BUTTON *buttons, UINT nbuttons, SIM_RESULT *res)
+{
+	SIM_SETUP setup;
+
+
+	memset(&setup, 0, sizeof setup);
+	setup.image = IMAGE;
+	setup.buttons = buttons;
+	setup.nbuttons = nbuttons;
+	setup.pcm = PCM;
+	setup.limitMs = 30000;
+	setup.untilStop = 1;
+	setup.latency = latency;
+	if (sim_run(&setup, res)) {
+		printf("%s: the simulation failed\n", name);
+		Failed = 1;
+	}
+	printf("%-24s start %5lu ms  end %5lu ms  samples %7lu  gaps %lu (%lu periods, longest %lu)\n", name,
+		(unsigned long)res->startMs, (unsigned long)res->ms, (unsigned long)res->samples,
+		(unsigned long)res->gaps, (unsigned long)res->underruns, (unsigned long)res->longestGap);
+}
+
+
+static void run (const char *name, const SIM_BUTTON *buttons, UINT nbuttons, SIM_RESULT *res)
+{
+	run_on(name, 0, buttons, nbuttons, res);
+}
+
+
+/* The playlist is played from POSITION.DAT to its end, every sample once */
+static void test_playlist (void)
+{
+	SIM_RESULT res;
+
+
+	build_image(0, 22050, 8, 0, 40000);
+	run("playlist", 0, 0, &res);
+	CHECK(res.stopped);
+	CHECK(res.gaps == 0);
+	CHECK(res.samples == 3 * 40000);
+	CHECK(res.period == 2000000 / 22050 - 1);
+	CHECK(pcm_matches(44, 8));
+
+	build_image(1, 44100, 16, 0, 40000);
+	run("playlist, INDEX.DAT", 0, 0, &res);
+	CHECK(res.stopped);
+	CHECK(res.gaps == 0);
+	CHECK(res.samples == 3 * 40000);
+	CHECK(pcm_matches(44, 16));
+
+	build_image(0, 44100, 16, 0, 40000);
+	run("playlist, 44.1 kHz", 0, 0, &res);
+	CHECK(res.stopped);
+	CHECK(res.gaps == 0);
+	CHECK(res.samples == 3 * 40000);
+	CHECK(pcm_matches(44, 16));
+}
+
+
+/* Tracks at different sampling rates, each one is played out at its own rate before
+/  the next one starts */
+static void test_rate_change (void)
+{
+	static const BYTE position[3] = {1, 1, 0};
+	static const DWORD rate[3] = {22050, 11025, 16000};
+	SIM_RESULT res;
+	char name[13];
+	UINT i;
+
+
+	if (fatimg_create(IMAGE, 4)) exit(2);
+	fatimg_add(FATIMG_ROOT, "POSITION.DAT", position, sizeof position, 0);
+	for (i = 0; i < 3; i++) {
+		WavSize[i] = fatimg_wav(Wav[i], rate[i], 2, 8, 0, 40000, (BYTE)(i * 50));
+		sprintf(name, "10%u.WAV", i + 1);
+		fatimg_add(FATIMG_ROOT, name, Wav[i], WavSize[i], 0);
+	}
+	if (fatimg_close()) exit(2);
+	run("rate change", 0, 0, &res);
+	CHECK(res.samples == 3 * 20000);
+	CHECK(res.period == 2000000 / 16000 - 1);
+	CHECK(res.longestGap < 32);		/* The drained FIFO waits for the first sector of the next track, about 2 ms */
+	CHECK(pcm_matches(44, 8));
+}
+
+
+/* A channel folder takes the place of the channel's files in the root directory, its
+/  start cluster is cached at startup, with and without INDEX.DAT */
+static void test_channel_folder (void)
+{
+	static const BYTE position[3] = {1, 1, 0};
+	static BYTE zeros[60416];
+	char name[13];
+	DWORD dir;
+	UINT i, index;
+	SIM_RESULT res;
+
+
+	for (index = 0; index < 2; index++) {
+		if (fatimg_create(IMAGE, 4)) exit(2);
+		fatimg_add(FATIMG_ROOT, "POSITION.DAT", position, sizeof position, 0);
+		if (index) fatimg_add(FATIMG_ROOT, "INDEX.DAT", zeros, sizeof zeros, 0);
+		fatimg_add(FATIMG_ROOT, "101.WAV", Wav[0], fatimg_wav(Wav[0], 8000, 1, 8, 0, 1000, 0), 0);
+		dir = fatimg_mkdir(FATIMG_ROOT, "1");
+		for (i = 0; i < 3; i++) {
+			WavSize[i] = fatimg_wav(Wav[i], 22050, 2, 8, 0, 40000, (BYTE)(i * 50));
+			sprintf(name, "00%u.WAV", i + 1);
+			fatimg_add(dir, name, Wav[i], WavSize[i], 0);
+		}
+		if (fatimg_close()) exit(2);
+		run(index ? "channel folder, INDEX.DAT" : "channel folder", 0, 0, &res);
+		CHECK(res.stopped);
+		CHECK(res.samples == 3 * 20000);
+		CHECK(res.gaps == 0);
+		CHECK(pcm_matches(44, 8));
+	}
+}
+
+
+/* A card of a latency model delays the data but doesn't change it. Data tokens
+/  of 3 to 4 ms run the FIFO empty, a replayed LATE histogram of a fast card doesn't. */
+static void test_latency (void)
+{
+	static const WORD late[DISKIMG_LATE_CLASSES * 2] = {900, 0, 80, 0, 20, 0, 0, 0, 0, 10};	/* Up to 3 read polls, 8..15 write polls */
+	static const DISKIMG_LATENCY slow = {"slow", 3000, 4000, 3000, 4000, 1000, 1000, 0, 0, 0};
+	static const DISKIMG_LATENCY trace = {"trace", 0, 0, 0, 0, 0, 0, 0, 0, late};
+	SIM_RESULT res;
+
+
+	build_image(0, 22050, 8, 0, 40000);
+	run_on("slow tokens", &slow, 0, 0, &res);
+	CHECK(res.samples == 3 * 40000);
+	CHECK(res.underruns > 0);
+	CHECK(pcm_matches(44, 8));
+
+	build_image(0, 22050, 8, 0, 40000);
+	run_on("LATE replay", &trace, 0, 0, &res);
+	CHECK(res.samples == 3 * 40000);
+	CHECK(res.gaps == 0);
+	CHECK(pcm_matches(44, 8));
+}
+
+
+/* A short press of FF skips the rest of the track */
+static void test_skip (void)
+{
+	static const SIM_BUTTON ff[] = {{2000, 11}, {2100, 0}};
+	SIM_RESULT res;
+
+
+	build_image(0, 22050, 8, 0, 40000);
+	run("skip", ff, 2, &res);
+	CHECK(res.stopped);
+	CHECK(res.samples > 2 * 40000 && res.samples < 3 * 40000);
+	CHECK(res.ms < 6767 - 500);
+}
+
+
+/* Chunks of more than 64 KiB before the data, e.g. with cover art */
+static void test_large_header (void)
+{
+	SIM_RESULT res;
+
+
+	build_image(0, 22050, 16, 70000, 20000);
+	run("70 KB header", 0, 0, &res);
+	CHECK(res.samples == 3 * 20000);
+	CHECK(pcm_matches(44 + 8 + 70000, 16));
+
+	build_image(1, 22050, 16, 70000, 20000);
+	run("70 KB header, INDEX.DAT", 0, 0, &res);
+	CHECK(res.samples == 3 * 20000);
+	CHECK(pcm_matches(44 + 8 + 70000, 16));
+}
+
+
+/* The data chunk header ends on the last byte of a sector (the data starts at 512) */
+static void test_data_at_sector_end (void)
+{
+	static const BYTE position[3] = {1, 1, 0};
+	SIM_RESULT res;
+	UINT i;
+
+
+	if (fatimg_create(IMAGE, 4)) exit(2);
+	fatimg_add(FATIMG_ROOT, "POSITION.DAT", position, sizeof position, 0);
+	for (i = 0; i < 3; i++) {
+		WavSize[i] = fatimg_wav(Wav[i], 22050, 2, 8, 460, 20000, (BYTE)(i * 50));
+		fatimg_add(FATIMG_ROOT, i ? (i == 1 ? "102.WAV" : "103.WAV") : "101.WAV", Wav[i], WavSize[i], 0);
+	}
+	if (fatimg_close()) exit(2);
+	run("data header at 504", 0, 0, &res);
+	CHECK(res.samples == 3 * 10000);
+	CHECK(pcm_matches(512, 8));
+}
+
+
+int main (void)
+{
+	test_playlist();
+	test_rate_change();
+	test_channel_folder();
+	test_latency();
+	test_skip();
+	test_data_at_sector_end();
+	test_large_header();
+	remove(IMAGE);
+	remove(PCM);
+	printf("test_player: %s\n", Failed ? "FAILED" : "OK");
+	return Failed;
+}
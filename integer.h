@@ -12,6 +12,8 @@
 
 #else			/* Embedded platform */
 
+#include <stdint.h>
+
 /* This type MUST be 8 bit */
 typedef unsigned char	BYTE;
 
@@ -24,9 +26,9 @@ typedef unsigned short	WCHAR;
 typedef int				INT;
 typedef unsigned int	UINT;
 
-/* These types MUST be 32 bit */
-typedef long			LONG;
-typedef unsigned long	DWORD;
+/* These types MUST be 32 bit (long on the AVR, int on a 64 bit host) */
+typedef int32_t			LONG;
+typedef uint32_t		DWORD;
 
 #endif
 
@@ -19,7 +19,11 @@
 #include <avr/pgmspace.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
+#include <string.h>
 #include "pff.h"
+#include "diskio.h"
+#include "hal.h"
+#include "probe.h"
 
 // fuses
 FUSES = {0xC1, 0xDD, 0xFF};	/* ATtiny861 fuse bytes: Low, High, Extended.
@@ -31,18 +35,45 @@ and use these values to program the fuse bits. */
 // constants
 #define FCC(c1,c2,c3,c4)	(((unsigned long)c4<<24)+((unsigned long)c3<<16)+((WORD)c2<<8)+(unsigned char)c1)	/* FourCC */
 #define MODE 1 // stereo
+#ifndef FIFO_SAMPLES
+#define FIFO_SAMPLES 128 // audio FIFO depth in samples of 2 bytes (64..256), build with -DFIFO_SAMPLES=n to change it in asmfunc.S too
+#endif
+#ifndef FIFO_STATS
+#define FIFO_STATS 0 // 1: count FIFO underruns and the fill level at each refill, written to STATS.DAT, build with -DFIFO_STATS=1 for asmfunc.S too
+#endif
+#ifndef FIFO_IN_GPIOR
+#define FIFO_IN_GPIOR 0 // 1: FIFO indexes in GPIOR1/GPIOR2 and a lean audio ISR, build with -DFIFO_IN_GPIOR=1 -ffixed-r2 -ffixed-r3 (see asmfunc.S)
+#endif
 #define FF_SPEED 100 // size of jump in kB
 #define RW_SPEED 200 // size of jump in kB
 #define FF_RW_AUDIO_CLUSTER_SIZE 50 // The size (in kB) of the Audio clusters hearable while rw/ff
 #define FF_RW_FAST_AUDIO_CLUSTER_SIZE 10 // The size (in kB) of the Audio clusters hearable while fast rw/ff
-#define FF_RW_PUSH_DURATION 200 //ms
-#define SKIP_DOUBLECLICK_DELAY 200 // ms
+#define TICK_MS 16 // ms per tick of the ui timebase, the watchdog interrupt period
+#define FF_RW_PUSH_DURATION (200 / TICK_MS) // ticks, a button held longer is a long press
+#define SKIP_DOUBLECLICK_DELAY (200 / TICK_MS) // ticks, a second press within this delay is a double click
 #define SKIP_BACKWARDS_THRESHOLD 100 // size of threshold in kB
 #define NUMBER_OF_JUMPS_TO_SWITCH_TO_FAST_FF_RW 5 // after a couple of jumps while FF RW, the jump size increases, like it used to do with CD players
 #define FAST_FF_RW_FACTOR 5 // times faster after NUMBER_OF_JUMPS_TO_SWITCH_TO_FAST_FF_RW jumps
 #define SWITCH_TO_IDLE_DURATION 60000 // ms
 #define IDLE_EFFECT_FREQUENCE 4000 // ms
 #define BLINK_SPEED 70 // ms
+#define BLINK_TICKS ((BLINK_SPEED + TICK_MS / 2) / TICK_MS) // BLINK_SPEED in ticks, for the animation frames
+#define ADC_SETTLE_COUNT 2 // number of conversions in a row needed for a stable button value, one per tick (~32 ms)
+#define ADC_SETTLE_WINDOW 2 // maximum deviation of a stable button value
+#define INDEX_CHANNELS 9 // channels covered by INDEX.DAT
+#define INDEX_TRACKS 99 // tracks per channel covered by INDEX.DAT, the root directory holds no more
+#define FOLDER_TRACKS 999 // tracks per channel in a channel folder
+#define INDEX_ENTRIES_PER_SECTOR (128 / sizeof(TRACK_INFO)) // entries are staged in Buff while rebuilding, so only the first 128 bytes (Buff with the smallest FIFO) of a sector are used
+#define INDEX_SECTORS_PER_CHANNEL ((INDEX_TRACKS + INDEX_ENTRIES_PER_SECTOR - 1) / INDEX_ENTRIES_PER_SECTOR)
+#define INDEX_SIZE ((1 + INDEX_CHANNELS * INDEX_SECTORS_PER_CHANNEL) * 512UL) // header sector + entry sectors
+#define INDEX_MAGIC FCC('I','N','D','4') // changes with the layout of INDEX.DAT, an INDEX.DAT of another layout is rebuilt
+#define TRACK_BITMAP_SIZE ((FOLDER_TRACKS + 1 + 7) / 8) // bytes of the bitmap of file numbers readDirectory() builds in Buff, fits the smallest FIFO
+#define TRACK_NO_FAT_CHAIN 0x80 // TRACK_INFO flag of a contiguous exFAT file, its clusters are not looked up in the FAT
+#define FIFO_STATS_BUCKETS 8 // classes of the FIFO fill level histogram
+#define FIFO_STATS_MAGIC FCC('F','I','F','O')
+#define PROBE_MAGIC FCC('P','R','O','B')
+#define DISK_STATS_MAGIC FCC('D','I','S','K')
+#define LATENCY_MAGIC FCC('L','A','T','E')
 
 // error codes
 #define INVALIDE_FILE 11
@@ -68,17 +99,65 @@ and use these values to program the fuse bits. */
 #define TRACK_8_LED 7
 #define RW_LED 8
 #define FF_LED 9
-
-// pinning
-#define LED_DATA PA3
-#define LED_CLK PA2
-#define LED_LE PA1
+#define ODD_TRACK_LEDS (1 << TRACK_1_LED | 1 << TRACK_3_LED | 1 << TRACK_5_LED | 1 << TRACK_7_LED)
+#define EVEN_TRACK_LEDS (1 << TRACK_2_LED | 1 << TRACK_4_LED | 1 << TRACK_6_LED | 1 << TRACK_8_LED)
 
 // structs and enums
 typedef struct {
 	unsigned long numberOfSamples;
 	unsigned long dataOffset; 
 } AUDIOFILE_INFO;
+typedef struct {
+	CLUST startCluster; // 0 if there is no playable file
+	DWORD numberOfSamples; // size of the audio data, the file is opened with the data as its end
+	DWORD dataOffset; // start of the audio data, chunks before it (e.g. with cover art) can be large
+	unsigned char flags; // format flags (bit 1: stereo, bit 4: 16 bit), as found by load_header(), and TRACK_NO_FAT_CHAIN
+	unsigned char samplingPeriod; // OCR0A for the file, as found by load_header()
+} TRACK_INFO;
+typedef enum {
+	RIFF_HEADER,
+	CHUNK_HEADER,
+	FMT_CHUNK,
+	SKIP_CHUNK,
+	DATA_CHUNK
+} PARSER_STATE;
+typedef struct {
+	unsigned long value; // the last four bytes read, as little endian dword
+	unsigned long id; // id of the current chunk
+	unsigned long size; // size of the current chunk, bytes left while skipping
+	unsigned char index; // byte index in the current header or chunk
+	unsigned char state; // PARSER_STATE
+	unsigned char al; // bytes per sample (all channels)
+	unsigned char flags; // channel and resolution flags, select the forwarding kernel
+	unsigned char samplingPeriod; // interval timer value for OCR0A
+	unsigned char error; // error code, 0 if OK
+} HEADER_PARSER;
+typedef enum {
+	NO_EVENT,
+	PRESS_EVENT, // a button went down
+	SHORT_RELEASE_EVENT, // released before FF_RW_PUSH_DURATION
+	CLICK_EVENT, // a single short press, no second one followed within SKIP_DOUBLECLICK_DELAY
+	DOUBLE_CLICK_EVENT, // the same button went down again within SKIP_DOUBLECLICK_DELAY
+	LONG_PRESS_EVENT, // held for FF_RW_PUSH_DURATION
+	RELEASE_EVENT // released after a long press
+} GESTURE_EVENT;
+typedef enum {
+	GESTURE_IDLE,
+	GESTURE_PRESSED,
+	GESTURE_PRESSED_AGAIN,
+	GESTURE_LONG_PRESSED,
+	GESTURE_RELEASED
+} GESTURE_STATE;
+typedef struct {
+	unsigned char button; // button of the current gesture (1..11)
+	unsigned char state; // GESTURE_STATE
+	unsigned char lastTick; // ticks at the last poll
+	uint16_t time; // ticks spent in the current state
+} GESTURE;
+typedef struct {
+	uint16_t leds; // LED states of the frame
+	unsigned char duration; // ticks the frame is shown, 0 ends the animation
+} LED_FRAME;
 typedef enum {
 	PLAY_MODE,
 	RW_MODE,
@@ -86,59 +165,97 @@ typedef enum {
 } PLAYER_MODE;
 
 // external methods
-void delay_ms (WORD);	/* Defined in asmfunc.S */
-void delay_us (WORD);	/* Defined in asmfunc.S */
+void fwd_mono8 (void);	/* Forwarding kernels, defined in asmfunc.S. Not callable, fwd_blk_part jumps to FwdKernel */
+void fwd_stereo8 (void);
+void fwd_mono16 (void);
+void fwd_stereo16 (void);
 EMPTY_INTERRUPT(PCINT_vect);
 
 // variables
-volatile unsigned char FifoRi, FifoWi, FifoCt;	/* FIFO controls */
-unsigned char Buff[256];		/* Audio output FIFO, needed by asmfunc.S too */
+#if FIFO_IN_GPIOR
+#define FifoRi GPIOR1	/* FIFO controls, FifoRi is owned by the audio ISR, FifoWi by fwd_blk_part */
+#define FifoWi GPIOR2
+#else
+volatile unsigned char FifoRi, FifoWi;	/* FIFO controls, FifoRi is owned by the audio ISR, FifoWi by fwd_blk_part */
+#endif
+unsigned char Buff[FIFO_SAMPLES * 2];	/* Audio output FIFO, needed by asmfunc.S too */
+void (*FwdKernel)(void) = fwd_stereo16;	/* Forwarding kernel for the current file, needed by asmfunc.S too */
 FATFS fileSystem;			/* File system object */
-DIR directory;			/* Directory object */
-FILINFO fileInfo;		/* File information */
 AUDIOFILE_INFO audioFileInfo;
+HEADER_PARSER headerParser;
+TRACK_INFO nextTrack; // the track following the current one, startCluster is 0 if there is none
+unsigned char nextTrackResolved = 0; // set when nextTrack is valid for the current track
 UINT rb;			/* Return value. Put this here to avoid avr-gcc's bug */ // TODO Maybe this is not a problem anymore? Remove?
 unsigned char currentChannel = 0;
-unsigned char currentFile = 0;
-uint16_t ledStates = 0;
+uint16_t currentFile = 0;
+uint16_t ledStates = 0; // LED states without a running animation
+uint16_t shownLEDs = 0xFFFF; // what the shift register currently shows, no valid state at power up
+const LED_FRAME *animationFrame = 0; // current frame of the running animation (flash), 0 if none
+uint16_t animationMask; // LEDs taken over by the running animation
+unsigned char animationTick; // ticks at the start of the current frame
+const LED_FRAME skipFfAnimation[] PROGMEM = {
+	{1 << RW_LED | ODD_TRACK_LEDS, BLINK_TICKS * 2},
+	{1 << FF_LED | EVEN_TRACK_LEDS, BLINK_TICKS * 2},
+	{0, 0}
+};
+const LED_FRAME skipRwAnimation[] PROGMEM = {
+	{1 << FF_LED | EVEN_TRACK_LEDS, BLINK_TICKS * 2},
+	{1 << RW_LED | ODD_TRACK_LEDS, BLINK_TICKS * 2},
+	{0, 0}
+};
+const LED_FRAME ffRwAnimation[] PROGMEM = {
+	{1 << FF_LED | 1 << RW_LED, BLINK_TICKS},
+	{0, BLINK_TICKS},
+	{1 << FF_LED | 1 << RW_LED, BLINK_TICKS},
+	{0, BLINK_TICKS},
+	{0, 0}
+};
+volatile unsigned char adcStable = 0; // the filtered button voltage, see ADC_vect
+unsigned char adcReference; // first conversion of the current run
+unsigned char adcSettleCount; // conversions in a row close to adcReference
+volatile unsigned char ticks = 0; // free running timebase (TICK_MS), counted by WDT_vect
+GESTURE gesture; // see pollGesture()
+unsigned long indexSector = 0; // first sector of INDEX.DAT, 0 if files are looked up in the directory
+uint16_t playlistLength[INDEX_CHANNELS]; // tracks 1..n of each channel exist, see scanDirectory()
+CLUST channelFolder[INDEX_CHANNELS]; // start cluster of the folder of each channel, 0 if its tracks are in the root directory
+unsigned long positionSector = 0; // sector of POSITION.DAT, 0 if not found
+unsigned char positionPending = 0; // set when currentFile still has to be written by storePosition()
+#if FIFO_STATS
+volatile uint16_t FifoUnderruns = 0;	/* Sample periods the audio ISR found the FIFO empty, needed by asmfunc.S too */
+uint16_t fifoHistogram[FIFO_STATS_BUCKETS]; // FIFO fill level at each refill, in FIFO_STATS_BUCKETS classes
+#endif
+#if PROBES
+volatile WORD ProbeClock = 0;	/* Audio sample periods, the timebase of the probes, needed by asmfunc.S too */
+PROBE_STATS probeStats[PROBE_COUNT]; // see probe.h
+#endif
+#if FIFO_STATS || PROBES
+unsigned long statsSector = 0; // sector of STATS.DAT, 0 if not found
+#endif
 
  
-// Initializes the analog in needed for reading the button:
-// 	   ADC Prescaler needs to be set so that the ADC input frequency is between 50 - 200kHz.
-//
-//            For more information, see table 17.5 "ADC Prescaler Selections" in
-//            chapter 17.13.2 "ADCSRA  ADC Control and Status Register A"
-//           (pages 140 and 141 on the complete ATtiny25/45/85 datasheet, Rev. 2586MAVR07/10)
-//
-//            Valid prescaler values for various clock speeds
-//
-// 	     Clock   Available prescaler values
-//            ---------------------------------------
-//              1 MHz   8 (125kHz), 16 (62.5kHz)
-//              4 MHz   32 (125kHz), 64 (62.5kHz)
-//              8 MHz   64 (125kHz), 128 (62.5kHz)
-//             16 MHz   128 (125kHz)
-//
-//   8-bit resolution:
-//   set ADLAR to 1 to enable the Left-shift result (only bits ADC9..ADC2 are available)
-//   then, only reading ADCH is sufficient for 8-bit results (256 values)
-void initADC() {
-  ADMUX =
-            (1 << ADLAR) |     // left shift result -> 8-bit mode
-			// ref. voltage to VCC
-            (0 << REFS1) |     // Set ref. voltage bit 1
-            (0 << REFS0) |     // Set ref. voltage bit 0
-			// use ADC6 as analog input
-            (0 << MUX3)  |     // MUX bit 3
-            (1 << MUX2)  |     // MUX bit 2
-            (1 << MUX1)  |     // MUX bit 1
-            (0 << MUX0);       // MUX bit 0
-
-  ADCSRA = 
-            (1 << ADEN)  |     // Enable ADC 
-            (1 << ADPS2) |     // set prescaler bit 2 
-            (1 << ADPS1) |     // set prescaler bit 1 
-            (1 << ADPS0);      // set prescaler bit 0  
+
+// Counts the ticks of the ui timebase and starts one button conversion per tick
+ISR(WDT_vect) {
+	ticks++;
+	hal_adc_start();
+}
+
+// Filters the button conversions, one per tick, so the buttons are sampled whatever the
+// main loop is busy with and nothing ever waits for the ADC. A value is taken over to 
+// adcStable once ADC_SETTLE_COUNT conversions in a row stayed within ADC_SETTLE_WINDOW of
+// the first one. This hides the transitions of the voltage while a button is pressed or
+// released.
+ISR(ADC_vect) {
+	unsigned char value = hal_adc_value();
+	if ((unsigned char)(value - adcReference + ADC_SETTLE_WINDOW) > 2 * ADC_SETTLE_WINDOW) {
+		// value moved, start a new run
+		adcReference = value;
+		adcSettleCount = 0;
+	} else if (adcSettleCount < ADC_SETTLE_COUNT) {
+		if (++adcSettleCount == ADC_SETTLE_COUNT) {
+			adcStable = adcReference;
+		}
+	}
 }
 
 // Ramp-up/down audio output (anti-pop feature) 
@@ -158,194 +275,330 @@ static void ramp (int up) {
 
 	for (unsigned char i = 0; i < 128; i++) {
 		value += direction;
-		OCR1A = value;
-		OCR1B = value;
+		hal_dac_write(value, value);
 		delay_us(100);
 	}
 }
 
 /* Enable audio output functions */
 static void audio_on (void)	{
-	if (!TCCR0B) {
-		FifoCt = 0; FifoRi = 0; FifoWi = 0;		/* Reset audio FIFO */
-		PLLCSR = 0b00000110;	/* Select PLL clock for TC1.ck */
-		TCCR1A = 0b10100011;	/* Start TC1 with OC1A/OC1B PWM enabled */
-		TCCR1B = 0b00000001;
+	if (!hal_audio_timer_running()) {
+		FifoRi = 0; FifoWi = 0;		/* Reset audio FIFO */
+		hal_pwm_start();
 		ramp(1);				/* Ramp-up to center level */
-		TCCR0A = 0b00000001;	/* Enable TC0.ck = 2MHz as interval timer */
-		TCCR0B = 0b00000010;
-		TIMSK = _BV(OCIE0A);
+		hal_audio_timer_start();
 	}
 }
 
 // Disable audio output functions
 static void audio_off (void) {
-	if (TCCR0B) {
-		TCCR0B = 0;				/* Stop audio timer */
+	if (hal_audio_timer_running()) {
+		hal_audio_timer_stop();	/* Stop audio timer */
 		ramp(0);				/* Ramp-down to GND level */
-		TCCR1A = 0;	TCCR1B = 0;	/* Stop PWM */
+		hal_pwm_stop();			/* Stop PWM */
 	}
 }
 
-// Loads the header
-// 
-// @return error code FRESULT or INVALIDE_FILE or if bigger than 1024, the number of samples
-static unsigned long load_header (void) {
-	unsigned long ret = 0;
-
-	/* Check RIFF-WAVE file header */
-	ret = pf_read(Buff, 12, &rb);
-	if (ret) {
-		return ret;
-	}
-	if (rb != 12 || LD_DWORD(Buff+8) != FCC('W','A','V','E')) {
-		return NOT_A_WAVE_FILE;
-	}
-
-	unsigned char al = 0;
-	for (;;) {
+// Feeds a byte of the file to the header parser. Called by pf_forward(), which reads the 
+// header in one pass instead of a read per chunk.
+//
+// @param b The next byte of the file
+// @return 0 to stop forwarding (data chunk found, error or large chunk to seek over), 1 else
+static BYTE parseHeader (BYTE b) {
+	headerParser.value = headerParser.value >> 8 | (unsigned long)b << 24;
+	headerParser.index++;
+	
+	switch (headerParser.state) {
+	case RIFF_HEADER:
+		// Check RIFF-WAVE file header
+		if (headerParser.index < 12) {
+			return 1;
+		}
+		if (headerParser.value != FCC('W','A','V','E')) {
+			headerParser.error = NOT_A_WAVE_FILE;
+			return 0;
+		}
+		break;
+	case CHUNK_HEADER:
 		// Get Chunk ID and size
-		ret = pf_read(Buff, 8, &rb); 
-		if (ret) {
-			return ret;
+		if (headerParser.index == 4) {
+			headerParser.id = headerParser.value;
+		}
+		if (headerParser.index < 8) {
+			return 1;
 		}
-		unsigned long chunkSize = LD_DWORD(&Buff[4]);
-		unsigned long id = LD_DWORD(&Buff[0]);
+		headerParser.size = headerParser.value;
 		
 		// analyze id
-		if (id == FCC('f','m','t',' ')) {	
+		if (headerParser.id == FCC('f','m','t',' ')) {
 			// some size checks
-			if (chunkSize & 1) {
+			if (headerParser.size & 1) {
 				// TODO What is this? If odd?
-				chunkSize++;
-			} else if (chunkSize > 128 || chunkSize < 16) { 
+				headerParser.size++;
+			} else if (headerParser.size > 128 || headerParser.size < 16) { 
 				// Wrong chunk size
-				return WRONG_CHUNK_SIZE;		
+				headerParser.error = WRONG_CHUNK_SIZE;
+				return 0;
 			}
-				
-			// Get the chunk content
-			ret = pf_read(Buff, chunkSize, &rb);
-			if (ret) {
-				return ret;
+			headerParser.state = FMT_CHUNK;
+			headerParser.index = 0;
+			return 1;
+		} else if (headerParser.id == FCC('d','a','t','a')) {
+			// Check if format valid
+			if (!headerParser.al) {
+				headerParser.error = INVALIDE_FILE;
+			// Check size
+			} else if (headerParser.size < 1024 || (headerParser.size & (headerParser.al - 1))) {
+				headerParser.error = WRONG_CHUNK_SIZE;	
 			}
-				
+			// file is ready to play now
+			headerParser.state = DATA_CHUNK;
+			return 0;
+		} else if (headerParser.id == FCC('D','I','S','P') || headerParser.id == FCC('f','a','c','t') || headerParser.id == FCC('L','I','S','T')) {
+			// skip unused chunks
+			if (headerParser.size & 1) {
+				headerParser.size++; // TODO What is this? If odd?...
+			}
+			if (!headerParser.size) {
+				break;
+			}
+			// small chunks are skipped in-stream, large ones (e.g. with cover art) by seeking
+			headerParser.state = SKIP_CHUNK;
+			return headerParser.size < 512;
+		} else {
+			// unknown chunk
+			headerParser.error = UNKNOWN_CHUNK;
+			return 0;
+		}
+	case FMT_CHUNK:
+		switch (headerParser.index) {
+		case 1:
 			// Check coding type (1: LPCM)
-			if (Buff[0] != 1) {
-				return NOT_LPCM_CODING_TYPE;				
+			if (b != 1) {
+				headerParser.error = NOT_LPCM_CODING_TYPE;				
 			}
-				
+			break;
+		case 3:
 			// Check channels (1/2: Mono/Stereo)
-			unsigned char numberOfChannels = Buff[2];
-			if (numberOfChannels < 1 && numberOfChannels > 2) {
-				return WRONG_NUMBER_OF_CHANNELS; 			
+			if (b < 1 || b > 2) {
+				headerParser.error = WRONG_NUMBER_OF_CHANNELS; 			
 			}
-				
 			// Save channel flag
-			GPIOR0 = numberOfChannels;
-			al = numberOfChannels;	
-									
-			/* Check resolution (8/16 bit) */
-			unsigned char resolution = Buff[14];
-			if (resolution != 8 && resolution != 16) {
-				return WRONG_RESOLUTION;
-			}
-				
-			// Save resolution flag
-			GPIOR0 |= resolution;							
-			if (resolution & 16) {
-				al <<= 1;
-			}
-				
+			headerParser.flags = b;
+			headerParser.al = b;
+			break;
+		case 8: {
 			// Check sampling frequency (8k-48k)
-			unsigned long frequency = LD_DWORD(&Buff[4]);					
+			unsigned long frequency = headerParser.value;
 			if (frequency < 8000 || frequency > 48000) {
-				return WRONG_SAMPLING_FREQ;
-			}
-				
-			// Set interval timer (sampling period)
-			OCR0A = (unsigned char)(16000000UL/8/frequency) - 1;	
-		} else if (id == FCC('d','a','t','a')) {
-			// Check if format valid
-			if (!al) {
-				return INVALIDE_FILE;
+				headerParser.error = WRONG_SAMPLING_FREQ;
 			}
-				
-			// TODO What does the following code do exactly?
-			// Check size
-			if (chunkSize < 1024 || (chunkSize & (al - 1))) {
-				return WRONG_CHUNK_SIZE;	
-			}
-			
-			// TODO The following code seems to make problems with intact files. What should it do and why isn't it working?
-			// Check offset
-// 			if (fileSystem.fptr & (al - 1)) {
-// 				return WRONG_OFFSET;		
-// 			}
-			
-			// return number of samples, file is ready to play now
-			return chunkSize;
-		} else if (id == FCC('D','I','S','P') || id == FCC('f','a','c','t') || id == FCC('L','I','S','T')) {
-			// skip unused chunks
-			if (chunkSize & 1) {
-				chunkSize++; // TODO What is this? If odd?...
+			// Save interval timer (sampling period)
+			headerParser.samplingPeriod = (unsigned char)(16000000UL/8/frequency) - 1;
+			break;
+		}
+		case 15:
+			/* Check resolution (8/16 bit) */
+			if (b != 8 && b != 16) {
+				headerParser.error = WRONG_RESOLUTION;
 			}
-			ret  = pf_lseek(fileSystem.fptr + chunkSize);
-			if (ret) {
-				return ret;
+			// Save resolution flag
+			headerParser.flags |= b;
+			if (b & 16) {
+				headerParser.al <<= 1;
 			}
-		} else {
-			// unknown chunk
-			return UNKNOWN_CHUNK;
+			break;
+		}
+		if (headerParser.error) {
+			return 0;
+		}
+		if (headerParser.index < headerParser.size) {
+			return 1;
+		}
+		break;
+	case SKIP_CHUNK:
+		if (--headerParser.size) {
+			return 1;
+		}
+		break;
+	case DATA_CHUNK:
+		// audio data is never taken for a chunk header
+		return 0;
+	}
+	
+	// continue with the next chunk header
+	headerParser.state = CHUNK_HEADER;
+	headerParser.index = 0;
+	return 1;
+}
+
+// Loads the header
+// 
+// @return error code FRESULT or INVALIDE_FILE or if bigger than 1024, the number of samples
+#if PROBES
+#define load_header load_header_unprobed	/* Timed by the wrapper below */
+#endif
+static unsigned long load_header (void) {
+	FRESULT ret;
+	
+	headerParser.state = RIFF_HEADER;
+	headerParser.index = 0;
+	headerParser.al = 0;
+	headerParser.error = 0;
+	for (;;) {
+		ret = pf_forward(parseHeader, 0xFFFF, &rb);
+		if (ret) {
+			return ret;
+		}
+		if (headerParser.error) {
+			return headerParser.error;
+		}
+		if (headerParser.state == DATA_CHUNK) {
+			// return number of samples, the file pointer is at the start of the data
+			return headerParser.size;
+		}
+		if (headerParser.state != SKIP_CHUNK) {
+			// end of file reached without finding the data
+			return headerParser.state == RIFF_HEADER ? NOT_A_WAVE_FILE : INVALIDE_FILE;
+		}
+		
+		// seek over a large chunk, which is pure arithmetic on the extent table
+		ret = pf_lseek(fileSystem.fptr + headerParser.size);
+		if (ret) {
+			return ret;
 		}
+		headerParser.state = CHUNK_HEADER;
+		headerParser.index = 0;
 	}
 }
+#if PROBES
+#undef load_header
+static unsigned long load_header (void) {
+	WORD t = probe_start();
+	unsigned long ret = load_header_unprobed();
+	probe_end(PROBE_LOAD_HEADER, t);
+	return ret;
+}
+#endif
 
-// Polls and returns the button state
+// Returns the button state, as filtered by ADC_vect
 //
 // @return The button that is currently pressed (1..11) or 0 of no button is pressed
 static unsigned char buttonPressed() {
-	ADCSRA |= (1 << ADSC);         // start ADC measurement
-	while (ADCSRA & (1 << ADSC) ); // wait till conversion complete
+	unsigned char value = adcStable;
 
-	if (ADCH < 6) {
+	if (value < 6) {
 		return 0;
-	} else if (ADCH < 17) {
+	} else if (value < 17) {
 		return 1;
-	} else if (ADCH < 26) {
+	} else if (value < 26) {
 		return 2;
-	} else if (ADCH < 40) {
+	} else if (value < 40) {
 		return 3;
-	} else if (ADCH < 63) {
+	} else if (value < 63) {
 		return 4;
-	} else if (ADCH < 89) {
+	} else if (value < 89) {
 		return 5;
-	} else if (ADCH < 129) {
+	} else if (value < 129) {
 		return 6;
-	} else if (ADCH < 155) {
+	} else if (value < 155) {
 		return 7;
-	} else if (ADCH < 184) {
+	} else if (value < 184) {
 		return 8;
-	} else if (ADCH < 205) {
+	} else if (value < 205) {
 		return 9;
-	} else if (ADCH < 224) {
+	} else if (value < 224) {
 		return 10;
 	} else {
 		return 11;
 	} 
 }
 
-// Opens and plays a file.
+// Advances the button gesture recognizer. It never waits, so it can be called between two
+// buffer updates; durations are measured in ticks.
+//
+// @param button Returns the button the event belongs to
+// @return GESTURE_EVENT, NO_EVENT if nothing happened
+#if PROBES
+#define pollGesture pollGesture_unprobed	/* Timed by the wrapper below */
+#endif
+static unsigned char pollGesture (unsigned char *button) {
+	unsigned char now = ticks;
+	unsigned char value = buttonPressed();
+
+	gesture.time += (unsigned char)(now - gesture.lastTick);
+	gesture.lastTick = now;
+	*button = gesture.button;
+	switch (gesture.state) {
+	case GESTURE_IDLE:
+		if (value) {
+			gesture.button = *button = value;
+			gesture.state = GESTURE_PRESSED;
+			gesture.time = 0;
+			return PRESS_EVENT;
+		}
+		break;
+	case GESTURE_PRESSED:
+	case GESTURE_PRESSED_AGAIN:
+		if (value != gesture.button) {
+			// only a single short press can still become a click
+			gesture.state = gesture.state == GESTURE_PRESSED ? GESTURE_RELEASED : GESTURE_IDLE;
+			gesture.time = 0;
+			return SHORT_RELEASE_EVENT;
+		}
+		if (gesture.time >= FF_RW_PUSH_DURATION) {
+			gesture.state = GESTURE_LONG_PRESSED;
+			return LONG_PRESS_EVENT;
+		}
+		break;
+	case GESTURE_LONG_PRESSED:
+		if (value != gesture.button) {
+			gesture.state = GESTURE_IDLE;
+			return RELEASE_EVENT;
+		}
+		break;
+	case GESTURE_RELEASED:
+		if (value == gesture.button) {
+			gesture.state = GESTURE_PRESSED_AGAIN;
+			gesture.time = 0;
+			return DOUBLE_CLICK_EVENT;
+		}
+		if (value || gesture.time >= SKIP_DOUBLECLICK_DELAY) {
+			// another button ends the click too, its press is reported by the next poll
+			gesture.state = GESTURE_IDLE;
+			return CLICK_EVENT;
+		}
+		break;
+	}
+	return NO_EVENT;
+}
+#if PROBES
+#undef pollGesture
+static unsigned char pollGesture (unsigned char *button) {
+	WORD t = probe_start();
+	unsigned char event = pollGesture_unprobed(button);
+	probe_end(PROBE_BUTTONS, t);
+	return event;
+}
+#endif
+
+// Opens a file and parses its header, without starting to play it.
 // 
-// @param play File number (1..999)
-// @return 0 if everything OK or FRESULT if not
-static FRESULT load (SHORT filenNumber) {
-	/* Open an audio file "nnn.WAV" (nnn=001..999) */
+// @param channel Channel (1..9)
+// @param number Track number within the channel (1..999)
+// @param track Returns what is needed to play the file
+// @return 0 if everything OK or FRESULT or error code if not
+static unsigned char openFile (unsigned char channel, uint16_t number, TRACK_INFO *track) {
+	/* Open an audio file "CTT.WAV" in the root directory or "NNN.WAV" in the channel folder, Buff is not used as it might be playing */
+	CLUST folder = channelFolder[channel - 1];
+	SHORT fileNumber = folder ? number : channel * 100 + number;
+	char name[8];
 	for(int i = 2; i >= 0; i--) {
-		Buff[i] = (unsigned char)(filenNumber % 10) + '0'; 
-		filenNumber /= 10;
+		name[i] = (unsigned char)(fileNumber % 10) + '0'; 
+		fileNumber /= 10;
 	}
-	strcpy_P((char*)&Buff[3], PSTR(".WAV"));
-	FRESULT ret = pf_open((char*)Buff);
+	strcpy_P(&name[3], PSTR(".WAV"));
+	FRESULT ret = pf_openin(folder, name); // only the folder is searched
 	if (ret) {
 		// An error has occurred while opening file
 		return ret;
@@ -358,9 +611,300 @@ static FRESULT load (SHORT filenNumber) {
 		return (unsigned char)numberOfSamples;
 	}
 
-	// save audio file specs	
-	audioFileInfo.numberOfSamples = numberOfSamples;
-	audioFileInfo.dataOffset = fileSystem.fptr;
+	// save audio file specs, the audio data must not run past the end of the file as that is not stored
+	if (numberOfSamples > fileSystem.fsize - fileSystem.fptr) {
+		numberOfSamples = fileSystem.fsize - fileSystem.fptr;
+	}
+	track->startCluster = fileSystem.org_clust;
+	track->numberOfSamples = numberOfSamples;
+	track->dataOffset = fileSystem.fptr;
+	track->flags = headerParser.flags | (fileSystem.flag & FA_NOFAT ? TRACK_NO_FAT_CHAIN : 0);
+	track->samplingPeriod = headerParser.samplingPeriod;
+	
+	return 0;
+}
+
+// Reads the entry of a file from INDEX.DAT. This costs one sector read instead of a 
+// directory scan and a header parse.
+// 
+// @param channel Channel (1..9)
+// @param number Track number within the channel (1..99)
+// @param track Returns what is needed to play the file
+// @return 0 if everything OK or FRESULT if not
+static unsigned char readIndexEntry (unsigned char channel, uint16_t number, TRACK_INFO *track) {
+	if (channel < 1 || channel > INDEX_CHANNELS || number < 1 || number > INDEX_TRACKS) {
+		return FR_NO_FILE;
+	}
+	number--;
+	if (disk_readp((BYTE*)track, indexSector + 1 + (channel - 1) * INDEX_SECTORS_PER_CHANNEL + number / INDEX_ENTRIES_PER_SECTOR,
+			(number % INDEX_ENTRIES_PER_SECTOR) * sizeof(TRACK_INFO), sizeof(TRACK_INFO))) {
+		return FR_DISK_ERR;
+	}
+	if (!track->startCluster) {
+		return FR_NO_FILE;
+	}
+	
+	return 0;
+}
+
+// Checks if a file is part of a playlist, without accessing the card.
+// 
+// @param channel Channel (1..9)
+// @param number Track number within the channel (1..999)
+// @return Not 0 if the file exists and all tracks of its channel before it too
+static unsigned char trackExists (unsigned char channel, uint16_t number) {
+	return channel >= 1 && channel <= INDEX_CHANNELS && number >= 1 && number <= playlistLength[channel - 1];
+}
+
+// Looks up a file in INDEX.DAT if available and covering it or in the directory else.
+// The open file stays open, so the next track can be looked up while one is playing
+// and a missing track doesn't stop the current one.
+// 
+// @param channel Channel (1..9)
+// @param number Track number within the channel (1..999)
+// @param track Returns what is needed to play the file
+// @return 0 if everything OK or FRESULT or error code if not
+static unsigned char findTrack (unsigned char channel, uint16_t number, TRACK_INFO *track) {
+	if (!trackExists(channel, number)) {
+		return FR_NO_FILE;
+	}
+	if (indexSector && number <= INDEX_TRACKS) {
+		return readIndexEntry(channel, number, track);
+	}
+	
+	// the file has to be opened, so the open one is opened again afterwards and seeked to
+	// its position. That stays within its first clusters when the next track is looked up,
+	// see prefetchNextTrack().
+	CLUST clust = fileSystem.org_clust;
+	DWORD size = fileSystem.fsize;
+	DWORD fptr = fileSystem.fptr;
+	BYTE flag = fileSystem.flag;
+	unsigned char ret = openFile(channel, number, track);
+	if (flag & FA_OPENED) {
+		FRESULT res = pf_openclust(clust, size, flag & FA_NOFAT);
+		if (res == FR_OK) {
+			res = pf_lseek(fptr);
+		}
+		if (res) {
+			return res;
+		}
+	}
+	return ret;
+}
+
+// Opens a file found by findTrack() at the start of its audio data and sets up the
+// audio output for its format. The FIFO keeps playing, so this can be used for a
+// gapless transition too.
+// 
+// @param track The file to open
+// @return 0 if everything OK or FRESULT if not
+static unsigned char startTrack (const TRACK_INFO *track) {
+	FRESULT ret = pf_openclust(track->startCluster, track->dataOffset + track->numberOfSamples, track->flags & TRACK_NO_FAT_CHAIN);
+	if (ret) {
+		return ret;
+	}
+	ret = pf_lseek(track->dataOffset);
+	if (ret) {
+		return ret;
+	}
+	// pick the forwarding kernel for the sample format, once per file
+	if (track->flags & 0x10) {
+		FwdKernel = (track->flags & 0x02) ? fwd_stereo16 : fwd_mono16;
+	} else {
+		FwdKernel = (track->flags & 0x02) ? fwd_stereo8 : fwd_mono8;
+	}
+	hal_audio_timer_period(track->samplingPeriod);
+	audioFileInfo.numberOfSamples = track->numberOfSamples;
+	audioFileInfo.dataOffset = track->dataOffset;
+	
+	// the next track is resolved again while this one is playing
+	nextTrack.startCluster = 0;
+	nextTrackResolved = 0;
+	
+	return 0;
+}
+
+// Writes the first 128 bytes of an INDEX.DAT sector, the rest of the sector is cleared.
+//
+// @param sector Sector number within INDEX.DAT
+// @param data The 128 bytes to write
+// @return 0 if everything OK or FRESULT if not
+static unsigned char writeIndexSector (unsigned long sector, const BYTE *data) {
+	if (disk_writep(0, indexSector + sector)
+			|| disk_writep(data, INDEX_ENTRIES_PER_SECTOR * sizeof(TRACK_INFO))
+			|| disk_writep(0, 0)) {
+		return FR_DISK_ERR;
+	}
+	return 0;
+}
+
+// Rebuilds INDEX.DAT. The first INDEX_TRACKS tracks of the playlists found by 
+// scanDirectory() are opened.
+//
+// @param signature The directory signature to store in the header
+// @return 0 if everything OK or FRESULT if not
+static unsigned char buildIndex (DWORD signature) {
+	TRACK_INFO *entries = (TRACK_INFO*)&Buff[sizeof(Buff) - INDEX_ENTRIES_PER_SECTOR * sizeof(TRACK_INFO)];
+	unsigned char ret;
+	
+	for (unsigned char channel = 1; channel <= INDEX_CHANNELS; channel++) {
+		unsigned char track = 1;
+		for (unsigned char sector = 0; sector < INDEX_SECTORS_PER_CHANNEL; sector++) {
+			for (unsigned char i = 0; i < INDEX_ENTRIES_PER_SECTOR; i++) {
+				if (track && trackExists(channel, track) && openFile(channel, track, &entries[i]) == 0) {
+					track++;
+				} else {
+					// playlist finished, all following entries of the channel are cleared
+					entries[i].startCluster = 0;
+					track = 0;
+				}
+			}
+			ret = writeIndexSector(1 + (channel - 1) * INDEX_SECTORS_PER_CHANNEL + sector, (BYTE*)entries);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+	
+	// the header is written last, so an interrupted rebuild is repeated at the next boot
+	ST_DWORD((BYTE*)entries, INDEX_MAGIC);
+	ST_DWORD((BYTE*)entries + 4, signature);
+	return writeIndexSector(0, (BYTE*)entries);
+}
+
+// Reads a directory for scanDirectory(). Every entry goes into the signature, the 
+// numbers of the track files are marked in a bitmap in Buff (the FIFO is not running 
+// yet) and the channel folders found in the root directory are noted.
+//
+// @param directory The directory, rewound
+// @param signature The signature to update
+// @return FR_OK if the whole directory was read or FRESULT if not
+static FRESULT readDirectory (DIR *directory, DWORD *signature) {
+	FILINFO fileInfo;
+	FRESULT ret;
+	
+	memset(Buff, 0, TRACK_BITMAP_SIZE);
+	while ((ret = pf_readdir(directory, &fileInfo)) == FR_OK && fileInfo.fname[0]) {
+		char *name = fileInfo.fname;
+		for (char *c = name; *c; c++) {
+			*signature = (*signature << 1 | *signature >> 31) + *c;
+		}
+		*signature += fileInfo.fclust ^ fileInfo.fsize ^ ((unsigned long)fileInfo.fdate << 16 | fileInfo.ftime);
+		
+		// "1".."9", a channel folder, only looked for in the root directory
+		if (!directory->sclust && (fileInfo.fattrib & AM_DIR)
+				&& name[0] >= '1' && name[0] <= '0' + INDEX_CHANNELS && !name[1]) {
+			channelFolder[name[0] - '1'] = fileInfo.fclust;
+		}
+		// "NNN.WAV", "CTT.WAV" in the root directory
+		if (name[0] >= '0' && name[0] <= '9' && name[1] >= '0' && name[1] <= '9' && name[2] >= '0' && name[2] <= '9'
+				&& strcmp_P(&name[3], PSTR(".WAV")) == 0) {
+			uint16_t bit = (name[0] - '0') * 100 + (name[1] - '0') * 10 + (name[2] - '0');
+			Buff[bit / 8] |= 1 << (bit % 8);
+		}
+	}
+	return ret;
+}
+
+// Counts the tracks of a playlist in the bitmap built by readDirectory(). A playlist 
+// ends at its first missing track.
+//
+// @param first File number of the first track
+// @param max Maximum number of tracks
+// @return Number of tracks
+static uint16_t countTracks (uint16_t first, uint16_t max) {
+	uint16_t length = 0;
+	while (length < max && (Buff[(first + length) / 8] & (1 << ((first + length) % 8)))) {
+		length++;
+	}
+	return length;
+}
+
+// Scans the directories once after mounting. It calculates a signature of the files, 
+// which changes whenever a file is added, removed, renamed or replaced, caches the
+// start clusters of the channel folders in channelFolder and keeps the length of every
+// playlist in playlistLength, so its end is known without looking for a missing file.
+// A channel folder takes the place of the channel's files in the root directory. If a
+// directory can't be read, every track is looked for.
+//
+// @return The signature
+static DWORD scanDirectory () {
+	DWORD signature = 0;
+	DIR directory; // only needed at startup, so it doesn't take RAM from the FIFO
+	
+	for (unsigned char channel = 0; channel < INDEX_CHANNELS; channel++) {
+		playlistLength[channel] = INDEX_TRACKS;
+		channelFolder[channel] = 0;
+	}
+	if (pf_opendir(&directory, "") != FR_OK || readDirectory(&directory, &signature) != FR_OK) {
+		return signature;
+	}
+	for (unsigned char channel = 0; channel < INDEX_CHANNELS; channel++) {
+		playlistLength[channel] = countTracks((channel + 1) * 100 + 1, INDEX_TRACKS);
+	}
+	
+	for (unsigned char channel = 0; channel < INDEX_CHANNELS; channel++) {
+		if (!channelFolder[channel]) {
+			continue;
+		}
+		directory.sclust = channelFolder[channel];
+		if (pf_readdir(&directory, 0) != FR_OK || readDirectory(&directory, &signature) != FR_OK) {
+			playlistLength[channel] = FOLDER_TRACKS;
+			continue;
+		}
+		playlistLength[channel] = countTracks(1, FOLDER_TRACKS);
+	}
+	return signature;
+}
+
+// Scans the directories, checks INDEX.DAT and rebuilds it if the directory has changed
+// since it was written. Without a big enough, contiguous INDEX.DAT, files are looked up
+// in the directory.
+static void openIndex () {
+	DWORD signature = scanDirectory();
+	indexSector = 0;
+	if (pf_open("INDEX.DAT") != FR_OK || fileSystem.fsize < INDEX_SIZE) {
+		return;
+	}
+	if (pf_read(Buff, 8, &rb) != FR_OK || rb != 8) {
+		return;
+	}
+	unsigned long sector = fileSystem.dsect;
+	unsigned long magic = LD_DWORD(&Buff[0]);
+	DWORD storedSignature = LD_DWORD(&Buff[4]);
+	
+	// entries are addressed by sector, so the file must not be fragmented: the first sector
+	// of every cluster has to follow on the card (pf_lseek() to the byte after a cluster
+	// boundary, which works without the extent table too)
+	for (unsigned long ofs = 1; ofs < INDEX_SIZE; ofs += fileSystem.csize * 512UL) {
+		if (pf_lseek(ofs) != FR_OK || fileSystem.dsect != sector + ofs / 512) {
+			return;
+		}
+	}
+	
+	indexSector = sector;
+	if (magic != INDEX_MAGIC || storedSignature != signature) {
+		if (buildIndex(signature)) {
+			indexSector = 0;
+		}
+	}
+}
+
+// Opens and plays a file.
+// 
+// @param channel Channel (1..9)
+// @param number Track number within the channel (1..999)
+// @return 0 if everything OK or FRESULT if not
+static FRESULT load (unsigned char channel, uint16_t number) {
+	TRACK_INFO track;
+	unsigned char ret = findTrack(channel, number, &track);
+	if (ret) {
+		return ret;
+	}
+	ret = startTrack(&track);
+	if (ret) {
+		return ret;
+	}
 
 	// enable audio output
 	audio_on();
@@ -375,12 +919,197 @@ static unsigned long samplesLeftToRead() {
 	return audioFileInfo.numberOfSamples + audioFileInfo.dataOffset - fileSystem.fptr;
 }
 
+// Calculates the samples in the audio FIFO
+//
+// @return The number of samples not yet played
+static unsigned char fifoFill() {
+	unsigned char wi = FifoWi;
+	unsigned char ri = FifoRi;
+	unsigned char fill = wi - ri;
+	if (wi < ri) {
+		fill += FIFO_SAMPLES;
+	}
+	return fill;
+}
+
+#if FIFO_STATS
+// Counts the FIFO fill level into fifoHistogram, called before each refill
+static void sampleFifoFill () {
+	fifoHistogram[(uint16_t)fifoFill() * FIFO_STATS_BUCKETS / FIFO_SAMPLES]++;
+}
+
+#endif
+
+#if PROBES
+// Returns the timestamp of a probe entry
+WORD probe_start (void) {
+	BYTE sreg = SREG;
+	cli();
+	WORD t = ProbeClock;
+	SREG = sreg;
+	return t;
+}
+
+// Accounts the time since a probe entry to the probe's statistics
+//
+// @param probe PROBE
+// @param start Timestamp returned by probe_start()
+void probe_end (BYTE probe, WORD start) {
+	WORD t = probe_start() - start;
+	PROBE_STATS *stats = &probeStats[probe];
+	if (!stats->count || t < stats->min) {
+		stats->min = t;
+	}
+	if (t > stats->max) {
+		stats->max = t;
+	}
+	stats->total += t;
+	stats->count++;
+}
+#endif
+
+#if FIFO_STATS || PROBES
+// Writes the statistics since power up to the start of STATS.DAT, as tagged sections of little endian values:
+// "FIFO", the number of underruns and the FIFO_STATS_BUCKETS histogram classes (words), if FIFO_STATS
+// "PROB", min, max (words), total (dword) and count (word) of each probe in sample periods, if PROBES
+// "DISK", commands, data block bytes clocked and bytes used (dwords), if PROBES
+//
+// @return 0 if everything OK or FRESULT if not
+static unsigned char storeStats () {
+	if (!statsSector) {
+		return FR_NO_FILE;
+	}
+	if (disk_writep(0, statsSector)) {
+		return FR_DISK_ERR;
+	}
+#if FIFO_STATS
+	BYTE stats[6 + 2 * FIFO_STATS_BUCKETS];
+	ST_DWORD(stats, FIFO_STATS_MAGIC);
+	cli();
+	ST_WORD(&stats[4], FifoUnderruns);
+	sei();
+	for (unsigned char i = 0; i < FIFO_STATS_BUCKETS; i++) {
+		ST_WORD(&stats[6 + 2 * i], fifoHistogram[i]);
+	}
+	if (disk_writep(stats, sizeof(stats))) {
+		return FR_DISK_ERR;
+	}
+#endif
+#if PROBES
+	BYTE probe[10];
+	ST_DWORD(probe, PROBE_MAGIC);
+	if (disk_writep(probe, 4)) {
+		return FR_DISK_ERR;
+	}
+	for (unsigned char i = 0; i < PROBE_COUNT; i++) {
+		ST_WORD(&probe[0], probeStats[i].min);
+		ST_WORD(&probe[2], probeStats[i].max);
+		ST_DWORD(&probe[4], probeStats[i].total);
+		ST_WORD(&probe[8], probeStats[i].count);
+		if (disk_writep(probe, sizeof(probe))) {
+			return FR_DISK_ERR;
+		}
+	}
+	BYTE disk[20];
+	ST_DWORD(&disk[0], DISK_STATS_MAGIC);
+	ST_DWORD(&disk[4], diskStats.commands);
+	ST_DWORD(&disk[8], diskStats.clocked);
+	ST_DWORD(&disk[12], diskStats.used);
+	ST_DWORD(&disk[16], LATENCY_MAGIC);
+	if (disk_writep(disk, sizeof(disk))) {
+		return FR_DISK_ERR;
+	}
+	for (unsigned char i = 0; i < LATENCY_CLASSES; i++) {
+		ST_WORD(&disk[0], diskStats.readWait[i]);
+		ST_WORD(&disk[2], diskStats.writeBusy[i]);
+		if (disk_writep(disk, 4)) {
+			return FR_DISK_ERR;
+		}
+	}
+#endif
+	if (disk_writep(0, 0)) {
+		return FR_DISK_ERR;
+	}
+	return 0;
+}
+
+// Looks up the sector of STATS.DAT for storeStats()
+static void openStats () {
+	BYTE b;
+	statsSector = 0;
+	if (pf_open("STATS.DAT") == FR_OK && pf_read(&b, 1, &rb) == FR_OK && rb == 1) {
+		statsSector = fileSystem.dsect;
+	}
+}
+#endif
+
+// Stores a position of the current channel to POSITION.DAT. The sector found by readAndUpdatePosition() 
+// is written directly, so the open audio file stays open and doesn't need to be loaded again.
+//
+// @param file The file number within the current channel to store
+// @return 0 if everything OK or FRESULT if not
+#if PROBES
+#define storePosition storePosition_unprobed	/* Timed by the wrapper below */
+#endif
+static unsigned char storePosition(uint16_t file) {
+	positionPending = 0;
+	unsigned char writeBuffer[3];
+	writeBuffer[0] = currentChannel;
+	ST_WORD(&writeBuffer[1], file);
+	if (!positionSector) {
+		return FR_NO_FILE;
+	}
+	if (disk_writep(0, positionSector) || disk_writep(writeBuffer, 3) || disk_writep(0, 0)) {
+		return FR_DISK_ERR;
+	}
+#if FIFO_STATS || PROBES
+	// the statistics go along with every position, i.e. with every track change
+	storeStats();
+#endif
+	return 0;
+}
+#if PROBES
+#undef storePosition
+static unsigned char storePosition(uint16_t file) {
+	WORD t = probe_start();
+	unsigned char ret = storePosition_unprobed(file);
+	probe_end(PROBE_STORE_POSITION, t);
+	return ret;
+}
+#endif
+
+// Resolves the next track of the playlist while the current one is still playing, so 
+// updateAudioBuffer() can switch to it without a gap. This is done right after the first
+// refill, so findTrack() seeks back to a position near the start of the playing file.
+static void prefetchNextTrack() {
+	nextTrackResolved = 1;
+	if (findTrack(currentChannel, currentFile + 1, &nextTrack)) {
+		nextTrack.startCluster = 0;
+	}
+}
+
 // Fills the audio buffer with new data
 // 
 // @return 0 if everything OK, or an error code else
 static unsigned char updateAudioBuffer() {
 	unsigned char ret = 0;
 	
+#if FIFO_STATS
+	sampleFifoFill();
+#endif
+	
+	// the position of a gapless transition is written once the FIFO has been refilled from
+	// the new track, and the next track is resolved on a later pass, as both last longer
+	// than a FIFO that isn't full. A short track is near its end right from the start, so
+	// that is done as soon as the FIFO has been filled from the current one.
+	if (positionPending) {
+		if (fifoFill() > FIFO_SAMPLES / 2) {
+			storePosition(currentFile);
+		}
+	} else if (!nextTrackResolved && fileSystem.fptr != audioFileInfo.dataOffset) {
+		prefetchNextTrack();
+	}
+	
 	// Snip sector unaligned part
 	ret = pf_read(0, 512 - (fileSystem.fptr % 512), &rb);	
 	if (ret) {
@@ -396,12 +1125,28 @@ static unsigned char updateAudioBuffer() {
 	}
 	
 	if (rb != 1024) {
+		if (nextTrack.startCluster) {
+			// gapless transition, the FIFO keeps playing while the next track is started, its
+			// position is written on a later pass
+			currentFile++;
+			positionPending = 1;
+			// the FIFO has no marker for the end of a track, so at another sampling rate the
+			// samples of this track are played out first
+			if (nextTrack.samplingPeriod != hal_audio_timer_get_period()) {
+				while (FifoRi != FifoWi) {
+					hal_spin();
+				}
+			}
+			return startTrack(&nextTrack);
+		}
+		
 		// Wait for audio FIFO empty
-		while (FifoCt);
+		while (FifoRi != FifoWi) {
+			hal_spin();
+		}
 			
 		// Return DAC out to center
-		OCR1A = 0x80;
-		OCR1B = 0x80;
+		hal_dac_write(0x80, 0x80);
 		
 		return END_OF_FILE;
 	} else {
@@ -409,34 +1154,20 @@ static unsigned char updateAudioBuffer() {
 	}
 }
 
-static unsigned char storePosition() {
-	unsigned char writeBuffer[2];
-	writeBuffer[0] = currentChannel;
-	writeBuffer[1] = currentFile;
-	FRESULT ret = pf_open("POSITION.DAT");
-	ret = pf_write(writeBuffer, 2, &rb);
-	if (ret != 0 && rb != 2) {
-		return ret;
-	}
-	ret = pf_write(0, 0, &rb);
-	if (ret != 0) {
-		return ret;
-	}
-	return 0;
-}
-
 static unsigned char readAndUpdatePosition() {
+	positionSector = 0;
 	FRESULT ret = pf_open("POSITION.DAT");
 	if (ret != 0) {
 		return ret;
 	}
-	unsigned char readBuffer[2];
-	ret = pf_read(readBuffer, 2, &rb);
-	if (ret != 0 || rb != 2) {
+	unsigned char readBuffer[3] = {0, 0, 0};
+	ret = pf_read(readBuffer, 3, &rb); // a 2 byte POSITION.DAT holds track numbers up to 255
+	if (ret != 0 || rb < 2) {
 		return ret;
 	}
+	positionSector = fileSystem.dsect; // remember the sector for storePosition()
 	currentChannel = readBuffer[0];
-	currentFile = readBuffer[1];
+	currentFile = LD_WORD(&readBuffer[1]);
 	return 0;
 }
 
@@ -445,27 +1176,22 @@ static unsigned int loadCurrentFile() {
 	if (currentChannel == 0 || currentFile == 0) {
 		currentChannel = 0;
 		currentFile = 0;
-		storePosition();
+		storePosition(currentFile);
 		return FR_NO_FILE;
 	}
 	
 	// first check, if able to load file
-	unsigned char ret = load(currentChannel * 100 + currentFile);
+	unsigned char ret = load(currentChannel, currentFile);
 	if (ret == 0) {
-		// if OK, load position file and store current position
-		ret = storePosition();
-		if (ret != 0) {
-			return ret;
-		}
-		// load current file again, as otherwise we would be trying to listen to the position file
-		unsigned char ret = load(currentChannel * 100 + currentFile);
+		// if OK, store current position
+		ret = storePosition(currentFile);
 		if (ret != 0) {
 			return ret;
 		}
 	} else {
 		currentChannel = 0;
 		currentFile = 0;
-		ret = storePosition();
+		ret = storePosition(currentFile);
 		if (ret != 0) {
 			return ret;
 		}
@@ -489,21 +1215,57 @@ static FRESULT skipToLast() {
 	}
 }
 
+// Advances a running animation and shifts the LED states out, if they changed.
+// Called once per main loop iteration, so the animations run while playing.
+#if PROBES
+#define showLED showLED_unprobed	/* Timed by the wrapper below */
+#endif
 void showLED() {
-	for (int i = 0; i < 16; i++) {
-		if ((0x8000 >> i) & ledStates) {
-			PORTA |= (1 << LED_DATA);
-			} else {
-			PORTA &= ~(1 << LED_DATA);
+	uint16_t states = ledStates;
+	if (animationFrame) {
+		unsigned char duration = pgm_read_byte(&animationFrame->duration);
+		if ((unsigned char)(ticks - animationTick) >= duration) {
+			// next frame
+			animationTick += duration;
+			animationFrame++;
+			if (!pgm_read_byte(&animationFrame->duration)) {
+				animationFrame = 0;
+			}
 		}
-		PORTA |= (1 << LED_CLK);
-		PORTA &= ~(1 << LED_CLK);
+		if (animationFrame) {
+			states = (states & ~animationMask) | pgm_read_word(&animationFrame->leds);
+		}
+	}
+	if (states == shownLEDs) {
+		return;
 	}
-	PORTA |= (1 << LED_LE);
-	PORTA &= ~(1 << LED_LE);
+	shownLEDs = states;
+	
+	hal_led_shift(states);
+}
+#if PROBES
+#undef showLED
+void showLED() {
+	WORD t = probe_start();
+	showLED_unprobed();
+	probe_end(PROBE_LEDS, t);
+}
+#endif
+
+// Starts an animation, the LEDs not in mask keep showing ledStates
+//
+// @param frames Frame table in flash, terminated by a frame of duration 0
+// @param mask LEDs taken over by the animation
+void playAnimation(const LED_FRAME *frames, uint16_t mask) {
+	animationFrame = frames;
+	animationMask = mask;
+	animationTick = ticks;
+	showLED();
 }
 
+// Sets all LED states, a running animation is stopped
 void lightLEDs(uint16_t states) {
+	animationFrame = 0;
 	ledStates = states;
 	showLED();
 }
@@ -545,74 +1307,20 @@ void blink(uint16_t led) {
 }
 
 void blinkFfRw() {
-	for (int i = 0; i < 2; i++) {
-		lightLED(FF_LED, 1);
-		lightLED(RW_LED, 1);
-		showLED();
-		delay_ms(BLINK_SPEED);
-		lightLED(FF_LED, 0);
-		lightLED(RW_LED, 0);
-		showLED();
-		delay_ms(BLINK_SPEED);
-	}
 	lightLED(currentChannel - 1, 1);
-	showLED();
+	playAnimation(ffRwAnimation, 1 << FF_LED | 1 << RW_LED);
 }
 
 void blinkSkipFf() {
-	lightLEDs(0);
-	lightLED(FF_LED, 0);
-	lightLED(RW_LED, 1);
-	lightLED(TRACK_1_LED, 1);
-	lightLED(TRACK_3_LED, 1);
-	lightLED(TRACK_5_LED, 1);
-	lightLED(TRACK_7_LED, 1);
-	showLED();
-	delay_ms(BLINK_SPEED * 2);
-	lightLED(FF_LED, 1);
-	lightLED(RW_LED, 0);
-	lightLED(TRACK_1_LED, 0);
-	lightLED(TRACK_3_LED, 0);
-	lightLED(TRACK_5_LED, 0);
-	lightLED(TRACK_7_LED, 0);
-	lightLED(TRACK_2_LED, 1);
-	lightLED(TRACK_4_LED, 1);
-	lightLED(TRACK_6_LED, 1);
-	lightLED(TRACK_8_LED, 1);
-	showLED();
-	delay_ms(BLINK_SPEED * 2);
-	
-	lightLEDs(0);
-	lightLED(currentChannel - 1, 1);
-	showLED();
+	// shown once the animation is over
+	ledStates = 1 << (currentChannel - 1);
+	playAnimation(skipFfAnimation, 0xFFFF);
 }
 
 void blinkSkipRw() {
-	lightLEDs(0);
-	lightLED(FF_LED, 1);
-	lightLED(RW_LED, 0);
-	lightLED(TRACK_2_LED, 1);
-	lightLED(TRACK_4_LED, 1);
-	lightLED(TRACK_6_LED, 1);
-	lightLED(TRACK_8_LED, 1);
-	showLED();
-	delay_ms(BLINK_SPEED * 2);
-	lightLED(FF_LED, 0);
-	lightLED(RW_LED, 1);
-	lightLED(TRACK_2_LED, 0);
-	lightLED(TRACK_4_LED, 0);
-	lightLED(TRACK_6_LED, 0);
-	lightLED(TRACK_8_LED, 0);
-	lightLED(TRACK_1_LED, 1);
-	lightLED(TRACK_3_LED, 1);
-	lightLED(TRACK_5_LED, 1);
-	lightLED(TRACK_7_LED, 1);
-	showLED();
-	delay_ms(BLINK_SPEED * 2);
-	
-	lightLEDs(0);
-	lightLED(currentChannel - 1, 1);
-	showLED();
+	// shown once the animation is over
+	ledStates = 1 << (currentChannel - 1);
+	playAnimation(skipRwAnimation, 0xFFFF);
 }
 
 void toggleRwFf() {
@@ -670,19 +1378,9 @@ void ledSequence() {
 }
 
 int main (void) {
-	initADC(); // initialize Analog input (control buttons)
-	
-	MCUSR = 0;								/* Clear reset status */
-	//WDTCR = _BV(WDE) | 0b110;				/* Enable WDT (1s) */
-	set_sleep_mode(SLEEP_MODE_PWR_DOWN);	/* Select power down mode for sleep */
-	PCMSK0 = 0b11111000;					/* Select pin change interrupt pins (SW1..SW8) */
-	PCMSK1 = 0b01110000;
-
-	/* Initialize ports */
-	PORTA = 0b00000000;		/* PORTA [-LLLLLLL]*/
-	DDRA  = 0b01111111;
-	PORTB = 0b01110001;		/* PORTB [-pHHLLLp] */
-	DDRB  = 0b00111110;
+	hal_adc_init(); // initialize Analog input (control buttons)
+	hal_init();
+	hal_tick_start();
 
 	sei();
 			
@@ -690,12 +1388,20 @@ int main (void) {
 		lightLEDs(0);
 		ledSequence();
 		if (pf_mount(&fileSystem) == FR_OK) {	/* Initialize FS */
+			// scan the directory, check the track index and rebuild it if needed, FF and RW LEDs are on meanwhile
+			uint16_t states = ledStates;
+			lightLEDs(1 << FF_LED | 1 << RW_LED);
+			openIndex();
+			lightLEDs(states);
 			
 			// check if a position is stored in position file
 			unsigned char ret = readAndUpdatePosition();
 			if (ret != 0) {
 				error(ret);
 			}
+#if FIFO_STATS || PROBES
+			openStats();
+#endif
 			
 			// if no position is defined yet, wait for a button to be pressed
 			if (currentFile == 0) {
@@ -717,7 +1423,6 @@ int main (void) {
 					}
 					delay_ms(1);
 				}
-				delay_ms(1); // the electronics around the button needs time to stabilize.
 				unsigned char buttonValue = buttonPressed();
 				
 				// clear leds
@@ -725,7 +1430,9 @@ int main (void) {
 				showLED();
 				
 				// wait for no button pressed
-				while (buttonPressed() != 0);
+				while (buttonPressed() != 0) {
+					hal_spin();
+				}
 				
 				// evaluate pressed button
 				if (buttonValue != 10 && buttonValue != 11) {
@@ -741,6 +1448,7 @@ int main (void) {
 								
 			// load file
 			PLAYER_MODE playerMode = PLAY_MODE;
+			gesture.state = GESTURE_IDLE; // a gesture left over from the last playback must not fire
 			ret = loadCurrentFile();
 			unsigned char playFfRwAudioCluster = 0; // to make jumps hearable when FF or RW
 			unsigned char numberOfFfRwJumps = 0;
@@ -762,112 +1470,72 @@ int main (void) {
 					break;
 				}
 								
-				// poll buttons
-				unsigned char buttonValue = buttonPressed();
-				if (buttonValue != 0) {
-					// debounce, as unsettled values were measured sometimes
-					delay_ms(1);
-					unsigned char nextButtonValue = buttonPressed();
-					if(buttonValue != nextButtonValue) {
-						buttonValue = 0;
-					}
-									
-					// evaluate pressed button
-					if (buttonValue == 10 && playerMode == PLAY_MODE) {
-						for (int i = 0; i < FF_RW_PUSH_DURATION; i++) {
-							if (buttonPressed() == 0) {
-								// if button was released, react immediately, as for skipping, people might want to push short and fast
-								break;
-							}
-							delay_ms(1);
-						}
-						
-						// check if button is still pressed
-						if (buttonPressed() == 10) {
-							playerMode = RW_MODE;
-							lightLED(currentChannel - 1, 1);
-							showLED();
-						} else {
-							// wait for a potential second button press
-							uint8_t skip = 0;
-							for (int i = 0; i < SKIP_DOUBLECLICK_DELAY; i++) {
-								if (buttonPressed() == 10) {
-									skip = 1;
-									break;
-								}
-								delay_ms(1);
-							}
-							
-							// evaluate and execute "skip to last" or "replay current file"
-							// skip backwards or to the start of the file
-							if (currentFile > 1 && (skip || fileSystem.fptr < (unsigned long)SKIP_BACKWARDS_THRESHOLD * 1024)) {
-								blinkSkipRw();
-								ret = skipToLast();
-								if (ret) {
-									error(ret);
-									break;
-								}
-							} else {
-								blinkFfRw();
-								ret= loadCurrentFile();
-								if (ret) {
-									error(ret);
-									break;
-								}
-							}
+				// poll buttons, this never waits, so the FIFO keeps being refilled
+				unsigned char button;
+				unsigned char event = pollGesture(&button);
+				showLED(); // advances a running LED animation
+				if (event == LONG_PRESS_EVENT && button == 10) {
+					playerMode = RW_MODE;
+					lightLED(currentChannel - 1, 1);
+					showLED();
+				} else if (event == LONG_PRESS_EVENT && button == 11) {
+					playerMode = FF_MODE;
+					lightLED(currentChannel - 1, 1);
+					showLED();
+				} else if ((event == CLICK_EVENT || event == DOUBLE_CLICK_EVENT) && button == 10) {
+					// evaluate and execute "skip to last" or "replay current file"
+					// skip backwards or to the start of the file
+					if (currentFile > 1 && (event == DOUBLE_CLICK_EVENT || fileSystem.fptr < (unsigned long)SKIP_BACKWARDS_THRESHOLD * 1024)) {
+						blinkSkipRw();
+						ret = skipToLast();
+						if (ret) {
+							error(ret);
+							break;
 						}
-					} else if (buttonValue == 11 && playerMode == PLAY_MODE) {
-						for (int i = 0; i < FF_RW_PUSH_DURATION; i++) {
-							if (buttonPressed() == 0) {
-								// if button was released, react immediately, as for skipping, people might want to push short and fast
-								break;
-							}
-							delay_ms(1);
+					} else {
+						blinkFfRw();
+						ret= loadCurrentFile();
+						if (ret) {
+							error(ret);
+							break;
 						}
-						
-						// check if button is still pressed
-						if (buttonPressed() == 11) {
-							playerMode = FF_MODE;
-							lightLED(currentChannel - 1, 1);
-							showLED();
-						} else {
-							// skip forward
-							blinkSkipFf();
-								ret = skipToNext();
-							if (ret) {
-								error(ret);
-								break;
-							}
+					}
+				} else if (event == SHORT_RELEASE_EVENT && button == 11) {
+					// skip forward, on release already, as for skipping, people might want to push short and fast
+					blinkSkipFf();
+					ret = skipToNext();
+					if (ret) {
+						error(ret);
+						break;
+					}
+				} else if ((event == PRESS_EVENT || event == DOUBLE_CLICK_EVENT) && button < 10) {
+					// if any other button
+					if (button == currentChannel) {
+						blinkSkipFf();
+						ret = skipToNext();
+						if (ret) {
+							error(ret);
+							break;
 						}
-					} else if (buttonValue != 0 && playerMode == PLAY_MODE) {
-						// if any other button
-						if (buttonValue == currentChannel) {
-							blinkSkipFf();
-							ret = skipToNext();
-							if (ret) {
-								error(ret);
-								break;
-							}
-						} else {
-							currentChannel = buttonValue;
-							currentFile = 1;
-							lightLEDs(0);
-							lightLED(currentChannel - 1, 1);
-							showLED();							
-							ret = loadCurrentFile();
-							if (ret) {
-								error(ret);
-								break;
-							}
+					} else {
+						currentChannel = button;
+						currentFile = 1;
+						lightLEDs(0);
+						lightLED(currentChannel - 1, 1);
+						showLED();							
+						ret = loadCurrentFile();
+						if (ret) {
+							error(ret);
+							break;
 						}
-						
-						// wait until button is released
-						while (buttonPressed());
 					}
-				} 
-				
-				// This part can't be written as an else, as buttonValue might have changed during last if
-				if (buttonValue == 0) {
+#if PROBES
+				} else if (event == LONG_PRESS_EVENT && button < 10) {
+					// holding a channel button dumps the probes to STATS.DAT
+					storeStats();
+					blinkFfRw();
+#endif
+				} else if (event == RELEASE_EVENT) {
 					playerMode = PLAY_MODE;
 					playFfRwAudioCluster = 0;
 					numberOfFfRwJumps = 0;
@@ -909,8 +1577,8 @@ int main (void) {
 								error(ret);
 								break;
 							}
-							// wait until no button is pressed, as funny noises may occur otherwise
-							while(buttonPressed() != 0);
+							// play on from the start, jumping back again and again would only make funny noises
+							playerMode = PLAY_MODE;
 						} else {
 							ret = skipToLast();
 							blinkSkipRw();
@@ -919,8 +1587,8 @@ int main (void) {
 								break;
 							}
 							
-							// jump to almost end of file
- 							ret = pf_lseek(fileSystem.fptr + audioFileInfo.numberOfSamples - jumpSize);
+							// jump to almost end of file (maps the cluster chain, later jumps back are resolved from the extent table)
+ 							ret = pf_lseek(audioFileInfo.dataOffset + audioFileInfo.numberOfSamples - jumpSize);
 							if (ret) {
 								error(ret);
 								break;
@@ -958,6 +1626,9 @@ int main (void) {
 			}
 
 			audio_off();	/* Disable audio output */
+#if FIFO_STATS || PROBES
+			storeStats();
+#endif
 		} else {
 			error(pf_mount(&fileSystem));
 		}
@@ -5,6 +5,7 @@
 #include <avr/io.h>
 #include "diskio.h"
 #include "pffconf.h"
+#include "probe.h"
 
 
 /* SPI control functions (defined in asmfunc.S) */
@@ -19,8 +20,10 @@ void delay_us(WORD us);
 #define CMD1	(0x40+1)	/* SEND_OP_COND (MMC) */
 #define	ACMD41	(0xC0+41)	/* SEND_OP_COND (SDC) */
 #define CMD8	(0x40+8)	/* SEND_IF_COND */
+#define CMD12	(0x40+12)	/* STOP_TRANSMISSION */
 #define CMD16	(0x40+16)	/* SET_BLOCKLEN */
 #define CMD17	(0x40+17)	/* READ_SINGLE_BLOCK */
+#define CMD18	(0x40+18)	/* READ_MULTIPLE_BLOCK */
 #define CMD24	(0x40+24)	/* WRITE_BLOCK */
 #define CMD55	(0x40+55)	/* APP_CMD */
 #define CMD58	(0x40+58)	/* READ_OCR */
@@ -39,6 +42,37 @@ void delay_us(WORD us);
 
 BYTE CardType;
 
+#if PROBES
+DISK_STATS diskStats;	/* Card traffic and latency, see probe.h */
+#endif
+
+#if _USE_STREAM
+static DWORD StrmSect;	/* Next sector of the running multiple block read (0:Not running) */
+#endif
+
+
+#if PROBES
+/*-----------------------------------------------------------------------*/
+/* Count a card wait in a latency histogram                              */
+/*-----------------------------------------------------------------------*/
+
+static
+void count_latency (
+	WORD *hist,		/* diskStats.readWait or diskStats.writeBusy */
+	WORD polls		/* Number of polls the card was not ready */
+)
+{
+	BYTE c = 0;
+
+
+	while (polls && c < LATENCY_CLASSES - 1) {	/* Class = bit length of polls */
+		polls >>= 1; c++;
+	}
+	hist[c]++;
+}
+#endif
+
+
 
 /*-----------------------------------------------------------------------*/
 /* Deselect the card and release SPI bus                                 */
@@ -71,13 +105,18 @@ BYTE send_cmd (
 		if (res > 1) return res;
 	}
 
-	/* Select the card and wait for ready */
-	DESELECT();
-	rcv_spi();
-	SELECT();
-	rcv_spi();
+	/* Select the card and wait for ready (the card stays selected while stopping a multiple block read) */
+	if (cmd != CMD12) {
+		DESELECT();
+		rcv_spi();
+		SELECT();
+		rcv_spi();
+	}
 
 	/* Send command packet */
+#if PROBES
+	diskStats.commands++;
+#endif
 	xmit_spi(cmd);						/* Start + Command index */
 	xmit_spi((BYTE)(arg >> 24));		/* Argument[31..24] */
 	xmit_spi((BYTE)(arg >> 16));		/* Argument[23..16] */
@@ -89,6 +128,7 @@ BYTE send_cmd (
 	xmit_spi(n);
 
 	/* Receive command response */
+	if (cmd == CMD12) rcv_spi();		/* Skip a stuff byte when stop reading */
 	n = 10;								/* Wait for a valid response in timeout of 10 attempts */
 	do {
 		res = rcv_spi();
@@ -99,6 +139,28 @@ BYTE send_cmd (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Terminate the multiple block read if running                          */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_STREAM
+static
+void stop_stream (void)
+{
+	WORD t;
+
+
+	if (StrmSect) {
+		StrmSect = 0;
+		send_cmd(CMD12, 0);				/* STOP_TRANSMISSION */
+		for (t = 50000; rcv_spi() != 0xFF && t; t--) ;	/* Wait for end of busy state */
+		release_spi();
+	}
+}
+#endif
+
+
+
 /*--------------------------------------------------------------------------
 
    Public Functions
@@ -119,6 +181,9 @@ DSTATUS disk_initialize (void)
 	USIPP = 0b00000000;	/* Attach USI to PORTB */
 	USICR = 0b00001000;	/* Enable the USI. DO pin is controlled by software */
 
+#if _USE_STREAM
+	StrmSect = 0;
+#endif
 	for (t = 10; t; t--) rcv_spi();	/* Dummy clocks */
 	SELECT();
 	for (t = 600; t; t--) rcv_spi();	/* Dummy clocks */
@@ -158,8 +223,11 @@ DSTATUS disk_initialize (void)
 /* Read partial sector                                                   */
 /*-----------------------------------------------------------------------*/
 
+#if PROBES
+#define disk_readp disk_readp_unprobed	/* Timed by the wrapper below */
+#endif
 DRESULT disk_readp (
-	BYTE *dest,		/* Pointer to the destination object to put data */
+	BYTE *dest,		/* Pointer to the destination object to put data (NULL:Forward to the wave FIFO) */
 	DWORD lba,		/* Start sector number (LBA) */
 	UINT ofs,		/* Byte offset in the sector (0..511) */
 	UINT cnt		/* Byte count (1..512), b15:destination flag */
@@ -168,8 +236,91 @@ DRESULT disk_readp (
 	DRESULT res;
 	BYTE rc;
 	WORD t;
+	DWORD ba;
+
+
+	ba = lba;
+	if (!(CardType & CT_BLOCK)) ba *= 512;		/* Convert LBA to BA if needed */
+
+	res = RES_ERROR;
+#if _USE_STREAM
+	if (!dest && lba == StrmSect) {		/* Next sector of the running multiple block read? */
+		rc = 0;
+	} else {
+		stop_stream();					/* Any other access terminates the stream */
+		rc = send_cmd(dest ? CMD17 : CMD18, ba);	/* READ_SINGLE_BLOCK, or READ_MULTIPLE_BLOCK to forward wave data */
+	}
+	if (rc == 0) {
+#else
+	if (send_cmd(CMD17, ba) == 0) {		/* READ_SINGLE_BLOCK */
+#endif
 
+		t = 30000;
+		do {							/* Wait for data packet in timeout of 100ms */
+			rc = rcv_spi();
+		} while (rc == 0xFF && --t);
+#if PROBES
+		count_latency(diskStats.readWait, 30000 - t);
+#endif
+
+		if (rc == 0xFE) {
+			fwd_blk_part(dest, ofs, cnt);
+#if PROBES
+			diskStats.clocked += 514;	/* The whole block is clocked in, the rest is discarded */
+			diskStats.used += cnt;
+#endif
+			res = RES_OK;
+		}
+	}
+
+#if _USE_STREAM
+	if (!dest) {
+		StrmSect = lba + 1;				/* Leave the card selected and sending the following sectors */
+		if (res == RES_OK) return res;
+		stop_stream();					/* Terminate the transfer on error */
+	}
+#endif
+	release_spi();
+
+	return res;
+}
+#if PROBES
+#undef disk_readp
+DRESULT disk_readp (
+	BYTE *dest,		/* Pointer to the destination object to put data (NULL:Forward to the wave FIFO) */
+	DWORD lba,		/* Start sector number (LBA) */
+	UINT ofs,		/* Byte offset in the sector (0..511) */
+	UINT cnt		/* Byte count (1..512), b15:destination flag */
+)
+{
+	WORD t = probe_start();
+	DRESULT res = disk_readp_unprobed(dest, lba, ofs, cnt);
+	probe_end(PROBE_DISK_READP, t);
+	return res;
+}
+#endif
 
+
+/*-----------------------------------------------------------------------*/
+/* Forward partial sector to a function byte by byte                     */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_FORWARD
+DRESULT disk_forwardp (
+	BYTE (*func)(BYTE),	/* Function to feed the data bytes to (returns 0 to stop forwarding) */
+	DWORD lba,		/* Start sector number (LBA) */
+	UINT ofs,		/* Byte offset in the sector (0..511) */
+	UINT *cnt		/* Byte count (1..512), returns number of bytes fed to the function, with FWD_STOPPED if it stopped */
+)
+{
+	DRESULT res;
+	BYTE rc;
+	WORD t, n, bc, st;
+
+
+#if _USE_STREAM
+	stop_stream();
+#endif
 	if (!(CardType & CT_BLOCK)) lba *= 512;		/* Convert LBA to BA if needed */
 
 	res = RES_ERROR;
@@ -179,9 +330,25 @@ DRESULT disk_readp (
 		do {							/* Wait for data packet in timeout of 100ms */
 			rc = rcv_spi();
 		} while (rc == 0xFF && --t);
+#if PROBES
+		count_latency(diskStats.readWait, 30000 - t);
+#endif
 
 		if (rc == 0xFE) {
-			fwd_blk_part(dest, ofs, cnt);
+			bc = 514 - ofs;				/* Number of bytes left in the block incl. CRC */
+			while (ofs--) rcv_spi();	/* Skip leading data bytes */
+			n = 0; st = 0;
+			do {						/* Feed data bytes until stopped or count reached */
+				n++;
+				if (!func(rcv_spi())) st = FWD_STOPPED;
+			} while (!st && n < *cnt);
+			*cnt = n | st;				/* A stop on the last byte is reported too */
+			bc -= n;
+			while (bc--) rcv_spi();		/* Discard trailing data bytes and CRC */
+#if PROBES
+			diskStats.clocked += 514;
+			diskStats.used += n;
+#endif
 			res = RES_OK;
 		}
 	}
@@ -190,6 +357,8 @@ DRESULT disk_readp (
 
 	return res;
 }
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -217,6 +386,9 @@ DWORD sc			/* Number of bytes to send, Sector number (LBA) or zero */
 		res = RES_OK;
 		} else {
 		if (sc) {	/* Initiate sector write process */
+#if _USE_STREAM
+			stop_stream();
+#endif
 			if (!(CardType & CT_BLOCK)) sc *= 512;	/* Convert to byte address if needed */
 			if (send_cmd(CMD24, sc) == 0) {			/* WRITE_SINGLE_BLOCK */
 				xmit_spi(0xFF); xmit_spi(0xFE);		/* Data block header */
@@ -224,10 +396,19 @@ DWORD sc			/* Number of bytes to send, Sector number (LBA) or zero */
 				res = RES_OK;
 			}
 			} else {	/* Finalize sector write process */
+#if PROBES
+			diskStats.clocked += 514;
+			diskStats.used += 512 - wc;
+#endif
 			bc = wc + 2;
-			while (bc--) xmit_spi(0);	/* Fill left bytes and CRC with zeros */
+			PORTB &= ~_BV(5);			/* Fill left bytes and CRC with zeros, DO(PB5) held low and clocked */
+			while (bc--) rcv_spi();		/* by rcv_spi() which is three times faster than xmit_spi(0) */
+			PORTB |= _BV(5);
 			if ((rcv_spi() & 0x1F) == 0x05) {	/* Receive data resp and wait for end of write process in timeout of 500ms */
 				for (bc = 5000; rcv_spi() != 0xFF && bc; bc--) delay_us(100);	/* Wait ready */
+#if PROBES
+				count_latency(diskStats.writeBusy, 5000 - bc);
+#endif
 				if (bc) res = RES_OK;
 			}
 			DESELECT();
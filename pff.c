@@ -27,10 +27,18 @@
 /                     Added _FS_FAT16 option.
 /
 / Jul 17, '17 Patch	  Added faster pf_lseek for seeking backwards
+/           Patch	  Added cluster extent table (_USE_FASTSEEK)
+/           Patch	  Added pf_openclust and start cluster in FILINFO
+/           Patch	  Added pf_forward
+/           Patch	  Follow contiguous runs of the cluster chain in one FAT read
+/           Patch	  Find directory entries with one read per directory sector
+/           Patch	  Added pf_openin
+/           Patch	  Added exFAT (_FS_EXFAT) with contiguous (NoFatChain) files
 /----------------------------------------------------------------------------*/
 
 #include "pff.h"		/* Petit FatFs configurations and declarations */
 #include "diskio.h"		/* Declarations of low level disk I/O functions */
+#include "probe.h"		/* Timing probes */
 
 
 
@@ -58,6 +66,10 @@
 #define _FS_32ONLY 0
 #endif
 
+#if _FS_EXFAT && !_USE_FORWARD
+#error _FS_EXFAT needs _USE_FORWARD.
+#endif
+
 #define ABORT(err)	{fs->flag = 0; return err;}
 
 
@@ -300,6 +312,14 @@
 #define BS_VolLab32			71
 #define BS_FilSysType32		82
 
+#define BPB_FatOfsEx		80
+#define BPB_FatSzEx			84
+#define BPB_DataOfsEx		88
+#define BPB_NumClusEx		92
+#define BPB_RootClusEx		96
+#define BPB_BytsPerSecEx	108
+#define BPB_SecPerClusEx	109
+
 #define MBR_Table			446
 
 #define	DIR_Name			0
@@ -326,6 +346,16 @@ static
 FATFS *FatFs;	/* Pointer to the file system object (logical drive) */
 
 
+/* Copy memory to memory */
+#if _FS_EXFAT
+static
+void mem_cpy (void* dst, const void* src, int cnt) {
+	char *d = (char*)dst;
+	const char *s = (const char *)src;
+	while (cnt--) *d++ = *s++;
+}
+#endif
+
 /* Fill memory */
 static
 void mem_set (void* dst, int val, int cnt) {
@@ -348,6 +378,9 @@ int mem_cmp (const void* dst, const void* src, int cnt) {
 /* FAT access - Read value of a FAT entry                                */
 /*-----------------------------------------------------------------------*/
 
+#if PROBES
+#define get_fat get_fat_unprobed	/* Timed by the wrapper below */
+#endif
 static
 CLUST get_fat (	/* 1:IO error, Else:Cluster status */
 	CLUST clst	/* Cluster# to get the link information */
@@ -385,11 +418,133 @@ CLUST get_fat (	/* 1:IO error, Else:Cluster status */
 	case FS_FAT32 :
 		if (disk_readp(buf, fs->fatbase + clst / 128, ((UINT)clst % 128) * 4, 4)) break;
 		return LD_DWORD(buf) & 0x0FFFFFFF;
+#endif
+#if _FS_EXFAT
+	case FS_EXFAT :
+		if (disk_readp(buf, fs->fatbase + clst / 128, ((UINT)clst % 128) * 4, 4)) break;
+		return LD_DWORD(buf);
 #endif
 	}
 
 	return 1;	/* An error occurred at the disk I/O layer */
 }
+#if PROBES
+#undef get_fat
+static
+CLUST get_fat (
+	CLUST clst	/* Cluster# to get the link information */
+)
+{
+	WORD t = probe_start();
+	clst = get_fat_unprobed(clst);
+	probe_end(PROBE_GET_FAT, t);
+	return clst;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Follow a contiguous run of links in one sector read      */
+/*-----------------------------------------------------------------------*/
+/* The card clocks a whole FAT sector for every get_fat(). get_run() lets
+/  the sector stream past walk_byte() instead, which follows the links as
+/  they come in as long as each one points to the very next entry. */
+
+#if _USE_FORWARD
+typedef struct {
+	CLUST	clst;	/* Cluster# whose link is coming in */
+	DWORD	left;	/* Links still to follow (0:Done) */
+	DWORD	nlnk;	/* Links followed */
+	BYTE	esz;	/* FAT entry size (2 or 4) */
+	BYTE	nb;		/* Bytes of the entry received */
+	BYTE	buf[4];	/* Entry being received */
+} FATWALK;
+
+static
+FATWALK *Walk;	/* Chain walk of get_run(), on its stack */
+
+static
+BYTE walk_byte (	/* 0:Stop the stream, 1:Continue */
+	BYTE d			/* Next byte of the FAT sector */
+)
+{
+	FATWALK *w = Walk;
+	CLUST nxt;
+
+
+	w->buf[w->nb++] = d;
+	if (w->nb < w->esz) return 1;		/* Entry not complete yet */
+	w->nb = 0;
+	nxt = (w->esz == 2) ? LD_WORD(w->buf) : LD_DWORD(w->buf) & 0x0FFFFFFF;
+	w->nlnk++;
+	w->left--;
+	if (nxt != w->clst + 1) w->left = 0;	/* End of the contiguous run */
+	w->clst = nxt;							/* The entry of nxt follows in the stream */
+	return w->left ? 1 : 0;
+}
+#endif
+
+
+#if PROBES
+#define get_run get_run_unprobed	/* Timed by the wrapper below */
+#endif
+static
+CLUST get_run (	/* 1:IO error, Else:Cluster status */
+	CLUST clst,	/* Cluster# to start from */
+	DWORD *nl	/* In: Links to follow at most (>0), Out: Links followed, all but the last one to the next cluster# */
+)
+{
+	FATFS *fs = FatFs;
+#if _USE_FORWARD
+	FATWALK w;
+	UINT ofs, cnt, epsect;
+#endif
+
+
+	if (fs->flag & FA_NOFAT) return clst + *nl;	/* No FAT chain, the clusters are contiguous */
+#if _USE_FORWARD
+#if _FS_FAT12
+	if (fs->fs_type == FS_FAT12) {		/* FAT12 entries straddle bytes, follow a single link */
+		*nl = 1;
+		return get_fat(clst);
+	}
+#endif
+	w.clst = clst; w.left = *nl; w.nlnk = 0; w.nb = 0;
+	w.esz = (_FS_FAT16 && fs->fs_type == FS_FAT16) ? 2 : 4;
+	epsect = 512 / w.esz;				/* FAT entries per sector */
+	Walk = &w;
+	*nl = 1;
+	do {								/* Stream the FAT sectors the run spans */
+		if (w.clst < 2 || w.clst >= fs->n_fatent) break;	/* Range check */
+		ofs = (UINT)(w.clst % epsect) * w.esz;
+		cnt = 512 - ofs;
+		if (disk_forwardp(walk_byte, fs->fatbase + w.clst / epsect, ofs, &cnt)) break;
+	} while (w.left);
+	Walk = 0;							/* w is gone after the return */
+	if (w.left) return 1;				/* Range or IO error */
+	*nl = w.nlnk;
+	return w.clst;
+#else
+	*nl = 1;
+	return get_fat(clst);
+#endif
+}
+#if PROBES
+#undef get_run
+static
+CLUST get_run (
+	CLUST clst,	/* Cluster# to start from */
+	DWORD *nl	/* In: Links to follow at most (>0), Out: Links followed */
+)
+{
+	WORD t = probe_start();
+	clst = get_run_unprobed(clst, nl);
+	probe_end(PROBE_GET_RUN, t);
+	return clst;
+}
+#endif
 
 
 
@@ -421,7 +576,7 @@ CLUST get_clust (
 	CLUST clst = 0;
 
 
-	if (_FS_32ONLY || (_FS_FAT32 && fs->fs_type == FS_FAT32)) {
+	if (_FS_32ONLY || ((_FS_FAT32 || _FS_EXFAT) && fs->fs_type >= FS_FAT32)) {
 		clst = LD_WORD(dir+DIR_FstClusHI);
 		clst <<= 16;
 	}
@@ -431,6 +586,119 @@ CLUST get_clust (
 }
 
 
+
+
+/*-----------------------------------------------------------------------*/
+/* Extent table - Get cluster# / Register a cluster of the open file     */
+/*-----------------------------------------------------------------------*/
+#if _USE_FASTSEEK
+
+static
+DWORD clmt_count (void)	/* Number of clusters mapped in the extent table */
+{
+	FATFS *fs = FatFs;
+	DWORD n = 0;
+	BYTE i;
+
+
+	for (i = 0; i < fs->n_ext; i++) n += fs->ext_ncl[i];
+	return n;
+}
+
+
+static
+CLUST clmt_clust (	/* 0:Not mapped, Else:Cluster# */
+	DWORD ncl		/* Cluster order from top of the file */
+)
+{
+	FATFS *fs = FatFs;
+	BYTE i;
+
+
+	for (i = 0; i < fs->n_ext; i++) {
+		if (ncl < fs->ext_ncl[i]) return fs->ext_clust[i] + (CLUST)ncl;	/* In this fragment? */
+		ncl -= fs->ext_ncl[i];			/* Next fragment */
+	}
+	return 0;
+}
+
+
+static
+void clmt_add (
+	DWORD ncl,		/* Cluster order from top of the file */
+	CLUST clst,		/* Cluster# found at the order */
+	CLUST n			/* Number of contiguous clusters from there */
+)
+{
+	FATFS *fs = FatFs;
+	BYTE i;
+
+
+	if (clst < 2 || clst >= fs->n_fatent) return;	/* Not a data cluster (end of chain) */
+	if (ncl != clmt_count()) return;				/* Not next to the mapped part of the chain */
+	i = fs->n_ext;
+	if (i && fs->ext_clust[i - 1] + fs->ext_ncl[i - 1] == clst) {	/* Contiguous to the last fragment? */
+		fs->ext_ncl[i - 1] += n;
+	} else if (i < _FS_EXTENTS) {					/* Start a new fragment */
+		fs->ext_clust[i] = clst;
+		fs->ext_ncl[i] = n;
+		fs->n_ext = i + 1;
+	}												/* Else the table is full, rest of the chain is followed with get_fat() */
+}
+
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get the cluster# that starts at the file R/W pointer                  */
+/*-----------------------------------------------------------------------*/
+#if _USE_READ || _USE_WRITE || _USE_FORWARD
+static
+CLUST next_clust (	/* 1:IO error, Else:Cluster status */
+	void
+)
+{
+	FATFS *fs = FatFs;
+	CLUST clst;
+#if _USE_FASTSEEK
+	DWORD ncl = fs->fptr / 512 / fs->csize;	/* Cluster order from top of the file */
+	DWORD nl;
+	UINT epsect;
+
+
+	clst = clmt_clust(ncl);
+	if (clst) return clst;				/* Found in the extent table */
+	if (fs->fptr == 0) {				/* On the top of the file? */
+		clst = fs->org_clust;
+		clmt_add(0, clst, 1);
+	} else {							/* Map the run that follows, up to the end of the file, */
+		nl = (fs->fsize - 1) / 512 / fs->csize - ncl + 1;
+		epsect = (_FS_FAT16 && fs->fs_type == FS_FAT16) ? 256 : 128;	/* FAT entries per sector */
+		if (!(fs->flag & FA_NOFAT) && nl > epsect - fs->curr_clust % epsect)	/* but not past the current FAT sector: */
+			nl = epsect - fs->curr_clust % epsect;	/* this runs while the FIFO drains */
+		clst = get_run(fs->curr_clust, &nl);
+		if (nl > 1) clmt_add(ncl, fs->curr_clust + 1, nl - 1);
+		clmt_add(ncl + nl - 1, clst, 1);
+		if (nl > 1) clst = fs->curr_clust + 1;
+	}
+#else
+	DWORD nl = 1;
+
+
+	if (fs->fptr == 0)					/* On the top of the file? */
+		clst = fs->org_clust;
+	else
+		clst = get_run(fs->curr_clust, &nl);
+#endif
+	return clst;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Rewind directory index                           */
 /*-----------------------------------------------------------------------*/
@@ -448,7 +716,7 @@ FRESULT dir_rewind (
 	clst = dj->sclust;
 	if (clst == 1 || clst >= fs->n_fatent)	/* Check start cluster range */
 		return FR_DISK_ERR;
-	if (_FS_FAT32 && !clst && (_FS_32ONLY || fs->fs_type == FS_FAT32))	/* Replace cluster# 0 with root cluster# if in FAT32 */
+	if ((_FS_FAT32 || _FS_EXFAT) && !clst && (_FS_32ONLY || fs->fs_type >= FS_FAT32))	/* Replace cluster# 0 with root cluster# if in FAT32/exFAT */
 		clst = (CLUST)fs->dirbase;
 	dj->clust = clst;						/* Current cluster */
 	dj->sect = (_FS_32ONLY || clst) ? clust2sect(clst) : fs->dirbase;	/* Current sector */
@@ -487,6 +755,10 @@ FRESULT dir_next (	/* FR_OK:Succeeded, FR_NO_FILE:End of table */
 		else {					/* Dynamic table */
 			if (((i / 16) & (fs->csize - 1)) == 0) {	/* Cluster changed? */
 				clst = get_fat(dj->clust);		/* Get next cluster */
+#if _FS_EXFAT
+				if (!clst && fs->fs_type == FS_EXFAT)	/* exFAT directory without FAT chain, */
+					return FR_NO_FILE;			/* only its first cluster is read */
+#endif
 				if (clst <= 1) return FR_DISK_ERR;
 				if (clst >= fs->n_fatent)		/* When it reached end of dynamic table */
 					return FR_NO_FILE;			/* Report EOT */
@@ -504,10 +776,153 @@ FRESULT dir_next (	/* FR_OK:Succeeded, FR_NO_FILE:End of table */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* exFAT: Collect an entry set into an FAT directory entry               */
+/*-----------------------------------------------------------------------*/
+
+/* An exFAT file is a set of entries: File (attributes, time stamp),
+/  Stream extension (start cluster, size, NoFatChain) and Name (UTF-16).
+/  Everything above the entry scan works on FAT form, so the set is
+/  folded into one when it is complete. A name that does not fit 8.3 in
+/  upper case ASCII comes out as a deleted entry and cannot be found. */
+
+#if _FS_EXFAT
+typedef struct {
+	BYTE	left;		/* Secondary entries left in the set (0:Not in a set) */
+	BYTE	attr;		/* File attributes */
+	BYTE	nofat;		/* NoFatChain flag */
+	BYTE	nlen;		/* Name length */
+	BYTE	nc;			/* Name characters received */
+	BYTE	pos;		/* Next position in sfn[] */
+	BYTE	ext;		/* The extension has begun */
+	BYTE	fit;		/* The name fits 8.3 */
+	BYTE	sfn[11];	/* Name in directory form */
+	DWORD	tstamp;		/* Last modified time stamp */
+	DWORD	clust;		/* Start cluster */
+	DWORD	size;		/* File size */
+} EXSET;
+
+static
+BYTE ex_entry (	/* 0:Go on, 1:The set is complete and dir[] holds it in FAT form */
+	EXSET *x,	/* Entry set being collected */
+	BYTE *dir	/* Entry read, replaced with the FAT form of the set */
+)
+{
+	BYTE i, c, t = dir[0];
+	WORD w;
+
+
+	if (t == 0x85) {					/* File entry starts a set */
+		x->left = dir[1];
+		x->attr = dir[4] & AM_MASK;
+		x->tstamp = LD_DWORD(dir+12);
+		x->nlen = x->nc = x->pos = x->ext = 0;
+		x->fit = 1;
+		mem_set(x->sfn, ' ', 11);
+		return 0;
+	}
+	if (!x->left) return 0;				/* Not in a set (bitmap, up-case table, label...) */
+	if (!(t & 0x80)) {					/* Broken set */
+		x->left = 0;
+		return 0;
+	}
+	if (t == 0xC0) {					/* Stream extension entry */
+		x->nofat = dir[1] & 2;
+		x->nlen = dir[3];
+		x->clust = LD_DWORD(dir+20);
+		x->size = LD_DWORD(dir+12) ? 0xFFFFFFFF : LD_DWORD(dir+8);	/* ValidDataLength, clip 4 GiB and over */
+	}
+	if (t == 0xC1) {					/* File name entry */
+		for (i = 2; i < 32 && x->nc < x->nlen; i += 2, x->nc++) {
+			w = LD_WORD(dir+i);
+			c = (BYTE)w;
+			if (c == '.' && !x->ext && x->pos) {	/* Dot of the extension */
+				x->ext = 1; x->pos = 8;
+			} else if (w <= ' ' || w >= 0x7F || c == '.' || x->pos >= (x->ext ? 11 : 8)) {
+				x->fit = 0;
+			} else {
+				if (IsLower(c)) c -= 0x20;
+				x->sfn[x->pos++] = c;
+			}
+		}
+	}
+	if (--x->left) return 0;
+
+	mem_cpy(dir, x->sfn, 11);			/* Complete, fold it into FAT form */
+	if (!x->fit) dir[DIR_Name] = 0xE5;
+	dir[DIR_Attr] = x->nofat ? x->attr | AM_NOFAT : x->attr;
+	ST_WORD(dir+DIR_FstClusHI, x->clust >> 16);
+	ST_WORD(dir+DIR_FstClusLO, x->clust);
+	ST_DWORD(dir+DIR_WrtTime, x->tstamp);	/* Time and date are in the same order */
+	ST_DWORD(dir+DIR_FileSize, x->size);
+	return 1;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
 
+/* Reading each entry on its own costs 16 block transfers per directory
+/  sector. With _USE_FORWARD the sector streams past find_byte() once
+/  instead, which compares every entry with the name as it comes in and
+/  stops the stream at the match. */
+
+#if _USE_FORWARD
+typedef struct {
+	BYTE	*dir;	/* Entry being received */
+	BYTE	*fn;	/* Name to find */
+	BYTE	nb;		/* Bytes of the entry received */
+	BYTE	miss;	/* The entry differs from the name */
+	BYTE	stat;	/* 0:Go on, 1:Found, 2:End of table */
+#if _FS_EXFAT
+	BYTE	exfat;	/* Entries are exFAT entry sets */
+	EXSET	x;		/* Entry set being collected */
+#endif
+} DIRSCAN;
+
+static
+DIRSCAN *Scan;	/* Directory scan of dir_find(), on its stack */
+
+static
+BYTE find_byte (	/* 0:Stop the stream, 1:Continue */
+	BYTE d			/* Next byte of the directory sector */
+)
+{
+	DIRSCAN *s = Scan;
+	BYTE i = s->nb;
+
+
+	s->dir[i] = d;
+	if (i == DIR_Name && d == 0) {		/* Reached to end of table */
+		s->stat = 2;
+		return 0;
+	}
+	if (i < 11 && d != s->fn[i]) s->miss = 1;
+	if (++i < 32) {						/* Entry not complete yet */
+		s->nb = i;
+		return 1;
+	}
+#if _FS_EXFAT
+	if (s->exfat)						/* Compare the set when it is complete */
+		s->miss = !ex_entry(&s->x, s->dir) || mem_cmp(s->dir, s->fn, 11);
+#endif
+	if (!s->miss && !(s->dir[DIR_Attr] & AM_VOL)) {	/* Is it a valid entry? */
+		s->stat = 1;
+		return 0;
+	}
+	s->nb = 0; s->miss = 0;				/* Next entry */
+	return 1;
+}
+#endif
+
+
+#if PROBES
+#define dir_find dir_find_unprobed	/* Timed by the wrapper below */
+#endif
 static
 FRESULT dir_find (
 	DIR *dj,		/* Pointer to the directory object linked to the file name */
@@ -515,12 +930,40 @@ FRESULT dir_find (
 )
 {
 	FRESULT res;
+#if _USE_FORWARD
+	DIRSCAN s;
+	UINT ofs, cnt;
+#else
 	BYTE c;
+#endif
 
 
 	res = dir_rewind(dj);			/* Rewind directory object */
 	if (res != FR_OK) return res;
 
+#if _USE_FORWARD
+	s.dir = dir; s.fn = dj->fn; s.stat = 0;
+#if _FS_EXFAT
+	s.exfat = (FatFs->fs_type == FS_EXFAT);
+	s.x.left = 0;
+#endif
+	Scan = &s;
+	do {
+		s.nb = 0; s.miss = 0;
+		ofs = (dj->index % 16) * 32;
+		cnt = 512 - ofs;
+		if (disk_forwardp(find_byte, dj->sect, ofs, &cnt)) {	/* Scan the rest of the sector */
+			res = FR_DISK_ERR; break;
+		}
+		cnt &= ~FWD_STOPPED;
+		dj->index += (cnt - 1) / 32;	/* Index of the last entry received */
+		if (s.stat) {					/* Found, or end of table */
+			res = (s.stat == 1) ? FR_OK : FR_NO_FILE; break;
+		}
+		res = dir_next(dj);				/* Next sector */
+	} while (res == FR_OK);
+	Scan = 0;						/* s is gone after the return */
+#else
 	do {
 		res = disk_readp(dir, dj->sect, (dj->index % 16) * 32, 32)	/* Read an entry */
 			? FR_DISK_ERR : FR_OK;
@@ -531,9 +974,24 @@ FRESULT dir_find (
 			break;
 		res = dir_next(dj);					/* Next entry */
 	} while (res == FR_OK);
+#endif
 
 	return res;
 }
+#if PROBES
+#undef dir_find
+static
+FRESULT dir_find (
+	DIR *dj,		/* Pointer to the directory object linked to the file name */
+	BYTE *dir		/* 32-byte working buffer */
+)
+{
+	WORD t = probe_start();
+	FRESULT res = dir_find_unprobed(dj, dir);
+	probe_end(PROBE_DIR_FIND, t);
+	return res;
+}
+#endif
 
 
 
@@ -550,7 +1008,11 @@ FRESULT dir_read (
 {
 	FRESULT res;
 	BYTE a, c;
+#if _FS_EXFAT
+	EXSET x;
 
+	x.left = 0;
+#endif
 
 	res = FR_NO_FILE;
 	while (dj->sect) {
@@ -559,6 +1021,10 @@ FRESULT dir_read (
 		if (res != FR_OK) break;
 		c = dir[DIR_Name];
 		if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of table */
+#if _FS_EXFAT
+		if (FatFs->fs_type == FS_EXFAT)	/* Go on to the end of an entry set */
+			c = ex_entry(&x, dir) ? dir[DIR_Name] : 0xE5;
+#endif
 		a = dir[DIR_Attr] & AM_MASK;
 		if (c != 0xE5 && c != '.' && !(a & AM_VOL))	/* Is it a valid entry? */
 			break;
@@ -667,6 +1133,7 @@ void get_fileinfo (		/* No return code */
 		fno->fsize = LD_DWORD(dir+DIR_FileSize);	/* Size */
 		fno->fdate = LD_WORD(dir+DIR_WrtDate);		/* Date */
 		fno->ftime = LD_WORD(dir+DIR_WrtTime);		/* Time */
+		fno->fclust = get_clust(dir);				/* Start cluster */
 	}
 	*p = 0;
 }
@@ -689,8 +1156,10 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 
 
 	while (*path == ' ') path++;		/* Strip leading spaces */
-	if (*path == '/') path++;			/* Strip heading separator if exist */
-	dj->sclust = 0;						/* Set start directory (always root dir) */
+	if (*path == '/') {					/* Strip heading separator if exist, */
+		path++;
+		dj->sclust = 0;					/* the path starts at the root dir then */
+	}									/* Else at the start directory set by the caller */
 
 	if ((BYTE)*path < ' ') {			/* Null path means the root directory */
 		res = dir_rewind(dj);
@@ -721,7 +1190,7 @@ FRESULT follow_path (	/* FR_OK(0): successful, !=0: error code */
 /*-----------------------------------------------------------------------*/
 
 static
-BYTE check_fs (	/* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record, 3:Error */
+BYTE check_fs (	/* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record, 3:Error, 4:exFAT */
 	BYTE *buf,	/* Working buffer */
 	DWORD sect	/* Sector# (lba) to check if it is an FAT boot record or not */
 )
@@ -735,6 +1204,8 @@ BYTE check_fs (	/* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:
 		return 0;
 	if (_FS_FAT32 && !disk_readp(buf, sect, BS_FilSysType32, 2) && LD_WORD(buf) == 0x4146)	/* Check FAT32 */
 		return 0;
+	if (_FS_EXFAT && !disk_readp(buf, sect, 3, 8) && !mem_cmp(buf, "EXFAT   ", 8))	/* Check exFAT */
+		return 4;
 	return 1;
 }
 
@@ -781,6 +1252,23 @@ FRESULT pf_mount (
 		}
 	}
 	if (fmt == 3) return FR_DISK_ERR;
+#if _FS_EXFAT
+	if (fmt == 4) {						/* exFAT volume */
+		if (disk_readp(buf, bsect, BPB_FatOfsEx, BPB_SecPerClusEx - BPB_FatOfsEx + 1)) return FR_DISK_ERR;
+		if (buf[BPB_BytsPerSecEx-80] != 9 || buf[BPB_SecPerClusEx-80] > 8)
+			return FR_NO_FILESYSTEM;	/* 512 byte sectors and clusters up to 128 KiB only */
+		fs->fatbase = bsect + LD_DWORD(buf+BPB_FatOfsEx-80);	/* FAT start sector (lba) */
+		fs->csize = 1 << buf[BPB_SecPerClusEx-80];				/* Number of sectors per cluster */
+		fs->n_rootdir = 0;
+		fs->n_fatent = LD_DWORD(buf+BPB_NumClusEx-80) + 2;		/* Last cluster# + 1 */
+		fs->dirbase = LD_DWORD(buf+BPB_RootClusEx-80);			/* Root directory start cluster */
+		fs->database = bsect + LD_DWORD(buf+BPB_DataOfsEx-80);	/* Data start sector (lba) */
+		fs->fs_type = FS_EXFAT;
+		fs->flag = 0;
+		FatFs = fs;
+		return FR_OK;
+	}
+#endif
 	if (fmt) return FR_NO_FILESYSTEM;	/* No valid FAT partition is found */
 
 	/* Initialize the file system object */
@@ -832,6 +1320,21 @@ FRESULT pf_mount (
 FRESULT pf_open (
 	const char *path	/* Pointer to the file name */
 )
+{
+	return pf_openin(0, path);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open a File in a Directory given by its Start Cluster                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_openin (
+	CLUST dclust,		/* Directory start cluster (0:Root dir) */
+	const char *path	/* Pointer to the file name, relative to the directory */
+)
 {
 	FRESULT res;
 	DIR dj;
@@ -843,15 +1346,42 @@ FRESULT pf_open (
 
 	fs->flag = 0;
 	dj.fn = sp;
+	dj.sclust = dclust;					/* Start directory */
 	res = follow_path(&dj, dir, path);	/* Follow the file path */
 	if (res != FR_OK) return res;		/* Follow failed */
 	if (!dir[0] || (dir[DIR_Attr] & AM_DIR))	/* It is a directory */
 		return FR_NO_FILE;
 
-	fs->org_clust = get_clust(dir);		/* File start cluster */
-	fs->fsize = LD_DWORD(dir+DIR_FileSize);	/* File size */
+	return pf_openclust(get_clust(dir), LD_DWORD(dir+DIR_FileSize),
+		_FS_EXFAT && fs->fs_type == FS_EXFAT && (dir[DIR_Attr] & AM_NOFAT));
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Open a File by its Start Cluster                                      */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_openclust (
+	CLUST sclust,		/* File start cluster */
+	DWORD fsize,		/* File size */
+	BYTE nofat			/* 1:Contiguous file without FAT chain (exFAT) */
+)
+{
+	FATFS *fs = FatFs;
+
+
+	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
+
+	fs->org_clust = sclust;				/* File start cluster */
+	fs->fsize = fsize;					/* File size */
 	fs->fptr = 0;						/* File pointer */
-	fs->flag = FA_OPENED;
+	fs->flag = nofat ? FA_OPENED | FA_NOFAT : FA_OPENED;
+#if _USE_FASTSEEK
+	fs->n_ext = 0;						/* Start the extent table with the first cluster */
+	clmt_add(0, fs->org_clust, 1);
+#endif
 
 	return FR_OK;
 }
@@ -890,10 +1420,7 @@ FRESULT pf_read (
 		if ((fs->fptr % 512) == 0) {				/* On the sector boundary? */
 			cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
 			if (!cs) {								/* On the cluster boundary? */
-				if (fs->fptr == 0)					/* On the top of the file? */
-					clst = fs->org_clust;
-				else
-					clst = get_fat(fs->curr_clust);
+				clst = next_clust();
 				if (clst <= 1) ABORT(FR_DISK_ERR);
 				fs->curr_clust = clst;				/* Update current cluster */
 			}
@@ -913,6 +1440,62 @@ FRESULT pf_read (
 }
 #endif
 
+/*-----------------------------------------------------------------------*/
+/* Forward File Data to a Function                                       */
+/*-----------------------------------------------------------------------*/
+#if _USE_FORWARD
+
+FRESULT pf_forward (
+	BYTE (*func)(BYTE),	/* Function to feed the data bytes to (returns 0 to stop forwarding) */
+	UINT btf,		/* Number of bytes to forward */
+	UINT* bf		/* Pointer to number of bytes forwarded */
+)
+{
+	DRESULT dr;
+	CLUST clst;
+	DWORD sect, remain;
+	UINT rcnt, fcnt;
+	BYTE cs;
+	FATFS *fs = FatFs;
+
+
+	*bf = 0;
+	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
+	if (!(fs->flag & FA_OPENED))		/* Check if opened */
+		return FR_NOT_OPENED;
+
+	remain = fs->fsize - fs->fptr;
+	if (btf > remain) btf = (UINT)remain;			/* Truncate btf by remaining bytes */
+
+	while (btf)	{									/* Repeat until all data forwarded or stopped */
+		if ((fs->fptr % 512) == 0) {				/* On the sector boundary? */
+			cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
+			if (!cs) {								/* On the cluster boundary? */
+				clst = next_clust();
+				if (clst <= 1) ABORT(FR_DISK_ERR);
+				fs->curr_clust = clst;				/* Update current cluster */
+			}
+			sect = clust2sect(fs->curr_clust);		/* Get current sector */
+			if (!sect) ABORT(FR_DISK_ERR);
+			fs->dsect = sect + cs;
+		}
+		rcnt = 512 - (UINT)fs->fptr % 512;			/* Forward the sector data in one pass */
+		if (rcnt > btf) rcnt = btf;
+		fcnt = rcnt;
+		dr = disk_forwardp(func, fs->dsect, (UINT)fs->fptr % 512, &fcnt);
+		if (dr) ABORT(FR_DISK_ERR);
+		rcnt = fcnt & ~FWD_STOPPED;					/* Bytes fed to the function */
+		fs->fptr += rcnt;							/* Update pointers and counters */
+		btf -= rcnt; *bf += rcnt;
+		if (fcnt & FWD_STOPPED) break;				/* Stopped by the function, on the last byte of the sector too */
+	}
+
+	return FR_OK;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
@@ -952,10 +1535,7 @@ FRESULT pf_write (
 		if ((UINT)fs->fptr % 512 == 0) {			/* On the sector boundary? */
 			cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));	/* Sector offset in the cluster */
 			if (!cs) {								/* On the cluster boundary? */
-				if (fs->fptr == 0)					/* On the top of the file? */
-					clst = fs->org_clust;
-				else
-					clst = get_fat(fs->curr_clust);
+				clst = next_clust();
 				if (clst <= 1) ABORT(FR_DISK_ERR);
 				fs->curr_clust = clst;				/* Update current cluster */
 			}
@@ -987,12 +1567,19 @@ FRESULT pf_write (
 /*-----------------------------------------------------------------------*/
 #if _USE_LSEEK
 
+#if PROBES
+#define pf_lseek pf_lseek_unprobed	/* Timed by the wrapper below */
+#endif
 FRESULT pf_lseek (
 	DWORD ofs		/* File pointer from top of file */
 )
 {
 	CLUST clst;
-	DWORD bcs, sect, ifptr;
+	DWORD bcs, sect, ifptr, nl;
+#if _USE_FASTSEEK
+	CLUST nxt;
+	DWORD ncl, icl;
+#endif
 	FATFS *fs = FatFs;
 
 
@@ -1005,6 +1592,29 @@ FRESULT pf_lseek (
 	fs->fptr = 0;
 	if (ofs > 0) {
 		bcs = (DWORD)fs->csize * 512;	/* Cluster size (byte) */
+#if _USE_FASTSEEK
+		ncl = (ofs - 1) / bcs;			/* Cluster order of the new pointer */
+		clst = clmt_clust(ncl);			/* Get it from the extent table */
+		if (!clst) {					/* Not mapped yet, follow the chain from the last mapped cluster */
+			icl = clmt_count() - 1;
+			clst = clmt_clust(icl);
+			if (ifptr > 0 && (ifptr - 1) / bcs > icl && (ifptr - 1) / bcs <= ncl) {	/* or from the current cluster if it is nearer */
+				icl = (ifptr - 1) / bcs;
+				clst = fs->curr_clust;
+			}
+			while (icl < ncl) {			/* Cluster following loop */
+				nl = ncl - icl;
+				nxt = get_run(clst, &nl);	/* Follow a run of the cluster chain */
+				if (nxt <= 1 || nxt >= fs->n_fatent) ABORT(FR_DISK_ERR);
+				if (nl > 1) clmt_add(icl + 1, clst + 1, nl - 1);	/* and map it */
+				clmt_add(icl + nl, nxt, 1);
+				icl += nl;
+				clst = nxt;
+			}
+		}
+		fs->curr_clust = clst;
+		fs->fptr = ofs;
+#else
 		if (ifptr > 0 &&
 			(ofs - 1) / bcs >= (ifptr - 1) / bcs) {	/* When seek to same or following cluster, */
 			fs->fptr = (ifptr - 1) & ~(bcs - 1);	/* start from the current cluster */
@@ -1013,7 +1623,7 @@ FRESULT pf_lseek (
 		} else {	/* When seek to back cluster, */
 			// try to follow cluster chain backwards (only possible if file is not fragmented)
 			while ((ofs - 1) / bcs < (ifptr - 1) / bcs ) {
-				if (get_fat(fs->curr_clust - 1) == fs->curr_clust) {
+				if ((fs->flag & FA_NOFAT) || get_fat(fs->curr_clust - 1) == fs->curr_clust) {
 					fs->curr_clust -= 1;
 					ifptr -= bcs;
 					} else {
@@ -1034,13 +1644,15 @@ FRESULT pf_lseek (
 			}
 		}
 		while (ofs > bcs) {				/* Cluster following loop */
-			clst = get_fat(clst);		/* Follow cluster chain */
+			nl = (ofs - 1) / bcs;
+			clst = get_run(clst, &nl);	/* Follow a run of the cluster chain */
 			if (clst <= 1 || clst >= fs->n_fatent) ABORT(FR_DISK_ERR);
 			fs->curr_clust = clst;
-			fs->fptr += bcs;
-			ofs -= bcs;
+			fs->fptr += nl * bcs;
+			ofs -= nl * bcs;
 		}
 		fs->fptr += ofs;
+#endif
 		sect = clust2sect(clst);		/* Current sector */
 		if (!sect) ABORT(FR_DISK_ERR);
 		fs->dsect = sect + (fs->fptr / 512 & (fs->csize - 1));
@@ -1048,6 +1660,18 @@ FRESULT pf_lseek (
 
 	return FR_OK;
 }
+#if PROBES
+#undef pf_lseek
+FRESULT pf_lseek (
+	DWORD ofs		/* File pointer from top of file */
+)
+{
+	WORD t = probe_start();
+	FRESULT res = pf_lseek_unprobed(ofs);
+	probe_end(PROBE_PF_LSEEK, t);
+	return res;
+}
+#endif
 #endif
 
 
@@ -1071,6 +1695,7 @@ FRESULT pf_opendir (
 		res = FR_NOT_ENABLED;
 	} else {
 		dj->fn = sp;
+		dj->sclust = 0;							/* Start at the root dir */
 		res = follow_path(dj, dir, path);		/* Follow the path to the directory */
 		if (res == FR_OK) {						/* Follow completed */
 			if (dir[0]) {						/* It is not the root dir */
@@ -28,7 +28,7 @@ extern "C" {
 	#error Wrong configuration file (pffconf.h).
 	#endif
 
-	#if _FS_FAT32
+	#if _FS_FAT32 || _FS_EXFAT
 	#define	CLUST	DWORD
 	#else
 	#define	CLUST	WORD
@@ -40,18 +40,22 @@ extern "C" {
 	typedef struct {
 		BYTE	fs_type;	/* FAT sub type */
 		BYTE	flag;		/* File status flags */
-		BYTE	csize;		/* Number of sectors per cluster */
-		BYTE	pad1;
+		WORD	csize;		/* Number of sectors per cluster */
 		WORD	n_rootdir;	/* Number of root directory entries (0 on FAT32) */
 		CLUST	n_fatent;	/* Number of FAT entries (= number of clusters + 2) */
 		DWORD	fatbase;	/* FAT start sector */
 		DWORD	dirbase;	/* Root directory start sector (Cluster# on FAT32) */
 		DWORD	database;	/* Data start sector */
-		DWORD	fptr;		/* File R/W pointer */
+		DWORD	fptr;		/* File R/W pointer (the file fields from here on are saved as a block by the player) */
 		DWORD	fsize;		/* File size */
 		CLUST	org_clust;	/* File start cluster */
 		CLUST	curr_clust;	/* File current cluster */
 		DWORD	dsect;		/* File current data sector */
+	#if _USE_FASTSEEK
+		BYTE	n_ext;		/* Number of fragments in the extent table */
+		CLUST	ext_clust[_FS_EXTENTS];	/* Start cluster of each fragment */
+		CLUST	ext_ncl[_FS_EXTENTS];	/* Number of clusters in each fragment */
+	#endif
 	} FATFS;
 
 
@@ -76,6 +80,7 @@ extern "C" {
 		WORD	ftime;		/* Last modified time */
 		BYTE	fattrib;	/* Attribute */
 		char	fname[13];	/* File name */
+		CLUST	fclust;		/* Start cluster */
 	} FILINFO;
 
 
@@ -99,9 +104,12 @@ extern "C" {
 
 	FRESULT pf_mount (FATFS* fs);								/* Mount/Unmount a logical drive */
 	FRESULT pf_open (const char* path);							/* Open a file */
+	FRESULT pf_openin (CLUST dclust, const char* path);			/* Open a file in a directory given by its start cluster */
+	FRESULT pf_openclust (CLUST sclust, DWORD fsize, BYTE nofat);	/* Open a file by its start cluster */
 	FRESULT pf_read (void* buff, UINT btr, UINT* br);			/* Read data from the open file */
 	FRESULT pf_write (const void* buff, UINT btw, UINT* bw);	/* Write data to the open file */
 	FRESULT pf_lseek (DWORD ofs);								/* Move file pointer of the open file */
+	FRESULT pf_forward (BYTE (*func)(BYTE), UINT btf, UINT* bf);	/* Forward data of the open file to a function byte by byte */
 	FRESULT pf_opendir (DIR* dj, const char* path);				/* Open a directory */
 	FRESULT pf_readdir (DIR* dj, FILINFO* fno);					/* Read a directory item from the open directory */
 
@@ -114,6 +122,7 @@ extern "C" {
 
 	#define	FA_OPENED	0x01
 	#define	FA_WPRT		0x02
+	#define	FA_NOFAT	0x04	/* The file has no FAT chain, its clusters are contiguous */
 	#define	FA__WIP		0x40
 
 
@@ -122,6 +131,7 @@ extern "C" {
 	#define FS_FAT12	1
 	#define FS_FAT16	2
 	#define FS_FAT32	3
+	#define FS_EXFAT	4
 
 
 	/* File attribute bits for directory entry */
@@ -134,6 +144,7 @@ extern "C" {
 	#define AM_DIR	0x10	/* Directory */
 	#define AM_ARC	0x20	/* Archive */
 	#define AM_MASK	0x3F	/* Mask of defined bits */
+	#define AM_NOFAT	0x80	/* No FAT chain, the clusters are contiguous (exFAT) */
 
 
 	/*--------------------------------*/
@@ -10,13 +10,20 @@
 /---------------------------------------------------------------------------*/
 
 #define	_USE_READ	1	/* Enable pf_read() function */
-#define	_USE_DIR	0	/* Enable pf_opendir() and pf_readdir() function */
+#define	_USE_DIR	1	/* Enable pf_opendir() and pf_readdir() function */
 #define	_USE_LSEEK	1	/* Enable pf_lseek() function */
+#define	_USE_FORWARD	1	/* Enable pf_forward() function */
 #define	_USE_WRITE	1	/* Enable pf_write() function */
+#define	_USE_STREAM	1	/* Read forwarded data with multiple block read (CMD18) */
+#define	_USE_FASTSEEK	1	/* Enable the cluster extent table of the open file */
+#define	_FS_EXTENTS	4	/* Number of fragments the extent table can hold (1..255) */
 
 #define _FS_FAT12	0	/* Enable FAT12 */
 #define _FS_FAT16	0	/* Enable FAT16 */
 #define _FS_FAT32	1	/* Enable FAT32 */
+#ifndef _FS_EXFAT			/* The host tests build pff a second time with -D_FS_EXFAT=1 */
+#define _FS_EXFAT	0	/* Enable exFAT (needs _USE_FORWARD, directories are read through 8.3 names) */
+#endif
 
 
 /*---------------------------------------------------------------------------/
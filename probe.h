@@ -0,0 +1,61 @@
+/*-----------------------------------------------------------------------
+/  Timing probes for the hot paths
+/-----------------------------------------------------------------------*/
+
+#ifndef _PROBE_DEFINED
+#define _PROBE_DEFINED
+
+#include "integer.h"
+
+/* Build with -DPROBES=1 to enable the probes, they compile out completely
+/  otherwise. A probed function is renamed to <name>_unprobed and wrapped by
+/  a function of the original name that times it. The timebase is ProbeClock,
+/  the number of audio sample periods counted by the audio ISR, so durations
+/  are only measured while audio is running. */
+
+#ifndef PROBES
+#define PROBES 0
+#endif
+
+#if PROBES
+
+typedef enum {
+	PROBE_DISK_READP = 0,
+	PROBE_GET_FAT,
+	PROBE_GET_RUN,
+	PROBE_PF_LSEEK,
+	PROBE_DIR_FIND,
+	PROBE_LOAD_HEADER,
+	PROBE_STORE_POSITION,
+	PROBE_BUTTONS,
+	PROBE_LEDS,
+	PROBE_COUNT
+} PROBE;
+
+typedef struct {
+	WORD	min;	/* Shortest duration (sample periods) */
+	WORD	max;	/* Longest duration */
+	DWORD	total;	/* Sum of all durations */
+	WORD	count;	/* Number of measurements */
+} PROBE_STATS;
+
+#define LATENCY_CLASSES	10	/* Class n counts waits of 2^(n-1) to 2^n-1 polls, the last one all longer waits */
+
+typedef struct {
+	DWORD	commands;	/* Commands sent to the card */
+	DWORD	clocked;	/* Data block bytes clocked in or out, incl. CRC */
+	DWORD	used;		/* Data block bytes actually used by the caller */
+	WORD	readWait[LATENCY_CLASSES];	/* Polls before a data token, a poll is one byte time */
+	WORD	writeBusy[LATENCY_CLASSES];	/* Polls of the busy state after a block write, a poll is 100us */
+} DISK_STATS;
+
+extern volatile WORD ProbeClock;
+extern PROBE_STATS probeStats[PROBE_COUNT];
+extern DISK_STATS diskStats;		/* Defined in mmc.c */
+
+WORD probe_start (void);				/* Returns the timestamp of a probe entry */
+void probe_end (BYTE probe, WORD start);	/* Accounts a probe exit to probeStats[probe] */
+
+#endif
+
+#endif	/* _PROBE_DEFINED */